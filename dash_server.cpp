@@ -0,0 +1,127 @@
+#include "mp4dash.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <cstdlib>
+#include <csignal>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+using namespace isobmff;
+
+// minimal HTTP/1.1 (GET, keep-alive) in front of DashPackager. for local testing only.
+
+static bool send_response(int fd, int status, const char *type, const string &body, const DashSegment *seg = nullptr) {
+    uint64_t len = seg != nullptr ? seg->size : body.size();
+    ostringstream h;
+    h << "HTTP/1.1 " << status << (status == 200 ? " OK" : " Not Found") << "\r\n"
+      << "Content-Type: " << type << "\r\n"
+      << "Content-Length: " << len << "\r\n"
+      << "Access-Control-Allow-Origin: *\r\n"
+      << "Connection: keep-alive\r\n\r\n";
+    string head = h.str();
+    if (!write_fd(fd, head.data(), head.size())) return false;
+    if (seg != nullptr) return seg->write(fd); // writev. sample data from the source mapping.
+    return write_fd(fd, body.data(), body.size());
+}
+
+static bool handle(int fd, DashPackager &packager, const string &path) {
+    int track, n = 0;
+    unsigned number;
+    const char *p = path.c_str();
+    if (path == "/test.mpd") {
+        ostringstream mpd;
+        packager.mpd(mpd);
+        return send_response(fd, 200, "application/dash+xml", mpd.str());
+    }
+    if (path == "/" || path == "/player.html") {
+        ifstream f("dash/player.html", ios::binary);
+        string html((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+        if (!html.empty()) return send_response(fd, 200, "text/html", html);
+    }
+    if (sscanf(p, "/init-stream%d.m4s%n", &track, &n) == 1 && p[n] == '\0' && track >= 0
+            && !packager.init(track).empty()) {
+        return send_response(fd, 200, "video/mp4", packager.init(track));
+    }
+    n = 0;
+    if (sscanf(p, "/chunk-stream%d-%u.m4s%n", &track, &number, &n) == 2 && p[n] == '\0' && track >= 0) {
+        auto seg = packager.segment(track, number);
+        if (seg != nullptr) return send_response(fd, 200, "video/mp4", "", seg.get());
+    }
+    return send_response(fd, 404, "text/plain", "not found\n");
+}
+
+static void serve(int fd, DashPackager &packager) {
+    string buf;
+    char tmp[4096];
+    for (;;) {
+        size_t end;
+        while ((end = buf.find("\r\n\r\n")) == string::npos) {
+            ssize_t r = ::read(fd, tmp, sizeof(tmp));
+            if (r <= 0 || buf.size() > 65536) {
+                ::close(fd);
+                return;
+            }
+            buf.append(tmp, r);
+        }
+        string request = buf.substr(0, buf.find("\r\n"));
+        buf.erase(0, end + 4);
+
+        istringstream line(request);
+        string method, path;
+        line >> method >> path;
+        path = path.substr(0, path.find('?'));
+        bool ok = method == "GET" ? handle(fd, packager, path) : send_response(fd, 404, "text/plain", "");
+        cout << method << " " << path << (ok ? "" : " (closed)") << endl;
+        if (!ok) break;
+    }
+    ::close(fd);
+}
+
+// usage: dash_server [-p port] [-c chunk_ms] [file.mp4]
+// http://localhost:8080/ plays dash/player.html with segments packaged on request.
+int main(int argc, char *argv[]) {
+    int port = 8080;
+    const char *src = "test2.mp4";
+    DashPackager::Options opt;
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        if (a == "-p" && i + 1 < argc) port = atoi(argv[++i]);
+        else if (a == "-c" && i + 1 < argc) opt.chunk_ms = max(0, atoi(argv[++i]));
+        else src = argv[i];
+    }
+
+    DashPackager packager;
+    if (!packager.open(src, opt)) {
+        cerr << "can't open " << src << endl;
+        return 1;
+    }
+    for (size_t i = 0; i < packager.trackCount(); i++) {
+        cout << "track" << i << ": " << packager.representation(i).codecs
+             << " segments: " << packager.segmentCount(i) << endl;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (s < 0 || ::bind(s, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 64) != 0) {
+        cerr << "can't listen on " << port << endl;
+        return 1;
+    }
+    cout << "listening on http://127.0.0.1:" << port << "/" << endl;
+
+    for (;;) {
+        int c = accept(s, nullptr, nullptr);
+        if (c < 0) continue;
+        thread(serve, c, ref(packager)).detach();
+    }
+    return 0;
+}
@@ -4,7 +4,13 @@
 #include <istream>
 #include <ostream>
 #include <vector>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
 #include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 namespace flv {
 
@@ -107,6 +113,30 @@ inline static int skip_data(FLVTagHeader &th, std::istream &is) {
     return th.size;
 }
 
+// tag body into buf (resized to th.size).
+template <typename T>
+inline static bool read_data(FLVTagHeader &th, std::istream &is, T &buf) {
+    buf.resize(th.size);
+    return th.size == 0 || (bool)is.read((char*)&buf[0], th.size);
+}
+
+static inline std::ostream& operator<<(std::ostream &os, const FLVHeader& fh) {
+    os.write(fh.signature, 3);
+    write8(os, fh.version);
+    write8(os, fh.type_flags);
+    write32(os, fh.data_offset);
+    return os;
+}
+
+static inline std::ostream& operator<<(std::ostream &os, const FLVTagHeader& th) {
+    write8(os, th.type);
+    write24(os, th.size);
+    write24(os, th.timestamp);
+    write8(os, th.timestamp >> 24);
+    write24(os, th.stream_id);
+    return os;
+}
+
 template <typename T>
 inline static void write_video(std::ostream &os, FLVTagHeader &th, const T &buf, uint8_t codec, int timeOffset, bool key, bool header = false) {
     th.size = buf.size() + (codec == VCODEC_AVC? 5 : 1);
@@ -135,23 +165,117 @@ inline static void write_audio(std::ostream &os, FLVTagHeader &th, const T &buf,
     os.write((char*)&buf[0], buf.size());
 }
 
-static inline std::ostream& operator<<(std::ostream &os, const FLVHeader& fh) {
-    os.write(fh.signature, 3);
-    write8(os, fh.version);
-    write8(os, fh.type_flags);
-    write32(os, fh.data_offset);
-    return os;
+static inline void put24(uint8_t *p, uint32_t d) {
+    p[0] = d >> 16; p[1] = d >> 8; p[2] = d;
+}
+static inline void put32(uint8_t *p, uint32_t d) {
+    p[0] = d >> 24; p[1] = d >> 16; p[2] = d >> 8; p[3] = d;
 }
 
-static inline std::ostream& operator<<(std::ostream &os, const FLVTagHeader& th) {
-    write8(os, th.type);
-    write24(os, th.size);
-    write24(os, th.timestamp);
-    write8(os, th.timestamp >> 24);
-    write24(os, th.stream_id);
-    return os;
+// all of iov, IOV_MAX at a time, retried on short writes and EINTR. iov is modified.
+// same as isobmff::writev_fd (mp4dash.h), flv.h doesn't depend on it.
+static inline bool writev_all(int fd, struct iovec *iov, size_t n) {
+    while (n > 0) {
+        if (iov->iov_len == 0) { // a write of 0 bytes is no progress below.
+            iov++;
+            n--;
+            continue;
+        }
+        ssize_t w = ::writev(fd, iov, std::min<size_t>(n, IOV_MAX));
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        for (; n > 0 && (size_t)w >= iov->iov_len; n--, iov++) w -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return true;
 }
 
+// buffered flv output. tag header, codec header, payload and PreviousTagSize are assembled
+// in one buffer and written batch bytes at a time. larger payloads go out with writev, uncopied.
+// sizes are counted here, no tellp(). flush() (or the destructor) writes what is left.
+class FlvWriter {
+public:
+    explicit FlvWriter(int fd, size_t batch = 1 << 20) : fd(fd), batch(batch), written(0), ok(true) {
+        buf.reserve(batch);
+    }
+    ~FlvWriter() {flush();}
+    FlvWriter(const FlvWriter&) = delete;
+    FlvWriter& operator=(const FlvWriter&) = delete;
+
+    // FLV header + PreviousTagSize0
+    bool header(uint8_t type_flags) {
+        uint8_t h[13] = {'F', 'L', 'V', 1, type_flags, 0, 0, 0, 9, 0, 0, 0, 0};
+        return append(h, sizeof(h), nullptr, 0, nullptr, 0);
+    }
+
+    // timestamp, time_offset: ms
+    bool video(uint32_t timestamp, const void *data, size_t n, uint8_t codec, int time_offset, bool key, bool header = false) {
+        uint8_t h[5] = {(uint8_t)((key? 0x10 : 0x20) | codec), (uint8_t)(header? 0x00 : 0x01)};
+        put24(h + 2, time_offset);
+        return tag(TAG_TYPE_VIDEO, timestamp, h, codec == VCODEC_AVC ? 5 : 1, data, n);
+    }
+
+    bool audio(uint32_t timestamp, const void *data, size_t n, uint8_t aformat, bool header = false) {
+        uint8_t h[2] = {aformat, (uint8_t)(header? 0x00 : 0x01)};
+        return tag(TAG_TYPE_AUDIO, timestamp, h, (aformat>>4) == ACODEC_AAC ? 2 : 1, data, n);
+    }
+
+    // any tag. prefix (up to 8 bytes) + data is the tag body.
+    bool tag(uint8_t type, uint32_t timestamp, const uint8_t *prefix, size_t prefix_size, const void *data, size_t n) {
+        uint8_t h[11 + 8];
+        if (prefix_size > sizeof(h) - 11) return false;
+        uint32_t size = prefix_size + n;
+        h[0] = type;
+        put24(h + 1, size);
+        put24(h + 4, timestamp);
+        h[7] = timestamp >> 24;
+        put24(h + 8, 0); // stream id
+        memcpy(h + 11, prefix, prefix_size);
+        uint8_t t[4];
+        put32(t, 11 + size);
+        return append(h, 11 + prefix_size, (const uint8_t*)data, n, t, sizeof(t));
+    }
+
+    bool flush() {
+        if (!buf.empty() && ok) {
+            struct iovec iov = {buf.data(), buf.size()};
+            ok = writev_all(fd, &iov, 1);
+        }
+        buf.clear();
+        return ok;
+    }
+
+    // bytes written, buffered included.
+    uint64_t size() const {return written;}
+    bool good() const {return ok;}
+
+private:
+    int fd;
+    size_t batch;
+    uint64_t written;
+    bool ok;
+    std::vector<uint8_t> buf;
+
+    bool append(const uint8_t *h, size_t hn, const uint8_t *data, size_t n, const uint8_t *t, size_t tn) {
+        written += hn + n + tn;
+        if (buf.size() + hn + n + tn > batch && n >= batch / 4) {
+            // large payload: buffered bytes, header, payload, trailer in one writev.
+            struct iovec iov[4] = {{buf.data(), buf.size()}, {(void*)h, hn}, {(void*)data, n}, {(void*)t, tn}};
+            if (ok) ok = writev_all(fd, iov, 4);
+            buf.clear();
+            return ok;
+        }
+        if (buf.size() + hn + n + tn > batch && !flush()) return false;
+        buf.insert(buf.end(), h, h + hn);
+        if (n > 0) buf.insert(buf.end(), data, data + n);
+        if (tn > 0) buf.insert(buf.end(), t, t + tn);
+        return ok;
+    }
+};
+
 } // namespace flv
 
 #endif
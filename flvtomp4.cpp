@@ -0,0 +1,522 @@
+#include "mp4dash.h"
+#include "flv.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+
+using namespace std;
+using namespace isobmff;
+
+// streaming flv -> fragmented mp4 (AVC/AAC). one sequential pass, only the current fragment is in memory.
+// a fragment (moof + mdat) starts at a video key frame after fragment_ms. (audio only: every fragment_ms)
+
+// exp-golomb bits of an RBSP.
+struct BitReader {
+    const uint8_t *p;
+    size_t n;
+    size_t pos; // bits
+
+    BitReader(const uint8_t *p, size_t n) : p(p), n(n), pos(0) {}
+    uint32_t bit() {
+        if (pos >= n * 8) return 0;
+        uint32_t b = p[pos >> 3] >> (7 - (pos & 7)) & 1;
+        pos++;
+        return b;
+    }
+    uint32_t bits(int k) {
+        uint32_t v = 0;
+        while (k-- > 0) v = v << 1 | bit();
+        return v;
+    }
+    uint32_t ue() {
+        int z = 0;
+        while (z < 32 && pos < n * 8 && bit() == 0) z++;
+        return z >= 32 ? 0 : (1u << z) - 1 + bits(z);
+    }
+    int32_t se() {
+        uint32_t v = ue();
+        return v & 1 ? (int32_t)((v + 1) / 2) : -(int32_t)(v / 2);
+    }
+};
+
+static void skip_scaling_list(BitReader &r, int size) {
+    int last = 8, next = 8;
+    for (int j = 0; j < size; j++) {
+        if (next != 0) next = (last + r.se() + 256) % 256;
+        last = next == 0 ? last : next;
+    }
+}
+
+// picture size from the first SPS of an AVCDecoderConfigurationRecord.
+static bool avc_size(const string &avcc, uint32_t &width, uint32_t &height) {
+    const uint8_t *c = (const uint8_t*)avcc.data();
+    if (avcc.size() < 8 || (c[5] & 0x1f) == 0) return false;
+    size_t len = be16(c + 6);
+    if (len < 4 || 8 + len > avcc.size()) return false;
+    vector<uint8_t> rbsp; // without the NAL header and emulation prevention bytes
+    int zeros = 0;
+    for (size_t i = 8 + 1; i < 8 + len; i++) {
+        if (zeros >= 2 && c[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = c[i] == 0 ? zeros + 1 : 0;
+        rbsp.push_back(c[i]);
+    }
+
+    BitReader r(rbsp.data(), rbsp.size());
+    uint32_t profile = r.bits(8);
+    r.bits(16); // constraint flags, level
+    r.ue(); // seq_parameter_set_id
+    uint32_t chroma = 1;
+    switch (profile) {
+    case 100: case 110: case 122: case 244: case 44: case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+        chroma = r.ue();
+        if (chroma == 3) r.bit(); // separate_colour_plane_flag
+        r.ue(); // bit_depth_luma
+        r.ue(); // bit_depth_chroma
+        r.bit(); // qpprime_y_zero_transform_bypass_flag
+        if (r.bit()) { // seq_scaling_matrix_present_flag
+            for (int i = 0; i < (chroma != 3 ? 8 : 12); i++) {
+                if (r.bit()) skip_scaling_list(r, i < 6 ? 16 : 64);
+            }
+        }
+    }
+    r.ue(); // log2_max_frame_num
+    uint32_t poc = r.ue();
+    if (poc == 0) {
+        r.ue();
+    } else if (poc == 1) {
+        r.bit();
+        r.se();
+        r.se();
+        for (uint32_t i = r.ue(); i > 0 && r.pos < rbsp.size() * 8; i--) r.se();
+    }
+    r.ue(); // max_num_ref_frames
+    r.bit(); // gaps_in_frame_num_value_allowed_flag
+    uint32_t mbs_w = r.ue() + 1;
+    uint32_t map_units_h = r.ue() + 1;
+    uint32_t frame_mbs_only = r.bit();
+    if (!frame_mbs_only) r.bit(); // mb_adaptive_frame_field_flag
+    r.bit(); // direct_8x8_inference_flag
+    width = mbs_w * 16;
+    height = (2 - frame_mbs_only) * map_units_h * 16;
+    if (r.bit()) { // frame_cropping_flag
+        uint32_t left = r.ue(), right = r.ue(), top = r.ue(), bottom = r.ue();
+        uint32_t cx = chroma == 1 || chroma == 2 ? 2 : 1;
+        uint32_t cy = (chroma == 1 ? 2 : 1) * (2 - frame_mbs_only);
+        width -= min(width, (left + right) * cx);
+        height -= min(height, (top + bottom) * cy);
+    }
+    return width > 0 && height > 0;
+}
+
+// sample rate and channels from an AudioSpecificConfig.
+static bool aac_config(const string &asc, uint32_t &rate, uint32_t &channels) {
+    static const uint32_t rates[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350};
+    BitReader r((const uint8_t*)asc.data(), asc.size());
+    if (r.bits(5) == 31) r.bits(6); // audioObjectType
+    uint32_t index = r.bits(4);
+    rate = index == 15 ? r.bits(24) : index < 13 ? rates[index] : 0;
+    channels = r.bits(4);
+    return asc.size() >= 2 && rate > 0;
+}
+
+// ES_Descriptor (esds payload) for an AAC AudioSpecificConfig.
+static string aac_esds(const string &asc) {
+    ByteWriter w(64 + asc.size());
+    w.u32(0); // version, flags
+    w.u8(0x03); // ES_DescrTag
+    w.u8(3 + 2 + 13 + 2 + asc.size() + 3);
+    w.u16(1); // ES_ID
+    w.u8(0);
+    w.u8(0x04); // DecoderConfigDescrTag
+    w.u8(13 + 2 + asc.size());
+    w.u8(0x40); // Audio ISO/IEC 14496-3
+    w.u8(0x15); // AudioStream
+    w.u24(0); // bufferSizeDB
+    w.u32(0); // maxBitrate
+    w.u32(0); // avgBitrate
+    w.u8(0x05); // DecSpecificInfoTag
+    w.u8(asc.size());
+    w.bytes(asc.data(), asc.size());
+    w.u8(0x06); // SLConfigDescrTag
+    w.u8(1);
+    w.u8(0x02);
+    return string((const char*)w.data(), w.size());
+}
+
+struct Track {
+    bool video;
+    string config; // avcC or AudioSpecificConfig
+    uint32_t time_scale;
+    uint32_t width, height, sample_rate, channels;
+    uint32_t id; // track_id in the output, 0: not in the output
+
+    // samples of the current fragment. the duration of the last one is known with the next sample.
+    struct Entry {
+        uint32_t duration;
+        uint32_t size;
+        uint32_t flags;
+        int32_t cts;
+    };
+    vector<Entry> samples;
+    string data;
+    uint64_t start_dts; // dts of samples[0]
+    uint64_t last_dts; // dts of samples.back()
+    BoxTFRA *tfra;
+
+    Track(bool video) : video(video), time_scale(1000), width(0), height(0), sample_rate(0), channels(0), id(0),
+                        start_dts(0), last_dts(0), tfra(nullptr) {}
+
+    Box *trak() const {
+        auto trak = new BoxSimpleList(BOX_TRAK);
+        auto tkhd = trak->adopt(new BoxTKHD());
+        tkhd->init();
+        tkhd->volume = video ? 0 : 0x100;
+        tkhd->width = width << 16;
+        tkhd->height = height << 16;
+        auto mdia = trak->adopt(new BoxSimpleList(BOX_MDIA));
+        auto mdhd = mdia->adopt(new BoxMDHD());
+        mdhd->time_scale = time_scale;
+        auto hdlr = mdia->adopt(new BoxHDLR(0));
+        hdlr->init();
+        memcpy(hdlr->media_type, video ? "vide" : "soun", 4);
+        hdlr->type_name = video ? "VideoHandler" : "SoundHandler";
+        auto minf = mdia->adopt(new BoxSimpleList(BOX_MINF));
+        auto stbl = minf->adopt(new BoxSimpleList(BOX_STBL));
+        stbl->adopt(stsd());
+        return trak;
+    }
+
+private:
+    // one sample entry: avc1 + avcC, mp4a + esds.
+    BoxSTSD *stsd() const {
+        string cfg = video ? config : aac_esds(config);
+        ByteWriter e(128 + cfg.size());
+        e.bytes("\0\0\0\0\0\0", 6);
+        e.u16(1); // data_reference_index
+        if (video) {
+            e.bytes(string(16, '\0').data(), 16);
+            e.u16(width);
+            e.u16(height);
+            e.u32(0x00480000); // 72dpi
+            e.u32(0x00480000);
+            e.u32(0);
+            e.u16(1); // frame_count
+            e.bytes(string(32, '\0').data(), 32); // compressorname
+            e.u16(0x18); // depth
+            e.u16(0xffff);
+        } else {
+            e.u32(0);
+            e.u32(0);
+            e.u16(channels);
+            e.u16(16); // samplesize
+            e.u32(0);
+            e.u32(sample_rate < 0x10000 ? sample_rate << 16 : 0);
+        }
+        e.u32(8 + cfg.size());
+        e.u32(video ? "avcC"_4cc : "esds"_4cc);
+        e.bytes(cfg.data(), cfg.size());
+
+        ByteWriter w(16 + e.size());
+        w.u32(0); // version, flags
+        w.u32(1); // entry_count
+        w.u32(8 + e.size());
+        w.u32(video ? "avc1"_4cc : "mp4a"_4cc);
+        w.bytes(e.data(), e.size());
+        auto stsd = new BoxSTSD(8 + w.size());
+        ByteReader r(w.data(), w.size());
+        stsd->decode(r);
+        return stsd;
+    }
+};
+
+class Remuxer {
+public:
+    uint32_t fragment_ms;
+
+    Remuxer(int fd, uint32_t fragment_ms) : fragment_ms(fragment_ms), fd(fd), video(true), audio(false),
+        initialized(false), failed(false), has_base(false), base_ms(0), fragment_start_ms(0), sequence(1), pos(0), fragments(0) {}
+    ~Remuxer() {
+        delete video.tfra;
+        delete audio.tfra;
+    }
+    Remuxer(const Remuxer&) = delete;
+    Remuxer& operator=(const Remuxer&) = delete;
+
+    // one tag body.
+    bool tag(const flv::FLVTagHeader &th, const vector<uint8_t> &body) {
+        if (body.empty()) return !failed;
+        if (th.type == flv::TAG_TYPE_VIDEO) {
+            uint8_t codec = body[0] & 0x0f;
+            bool key = (body[0] >> 4) == 1;
+            if (codec != flv::VCODEC_AVC || body.size() < 5) return unsupported("video codec", codec);
+            int32_t cts = (int32_t)(be24(&body[2]) << 8) >> 8; // SI24
+            if (body[1] == 0) return config(video, body, 5);
+            if (body[1] == 1) return sample(video, th.timestamp, cts, key, body, 5);
+        } else if (th.type == flv::TAG_TYPE_AUDIO) {
+            uint8_t codec = body[0] >> 4;
+            if (codec != flv::ACODEC_AAC || body.size() < 2) return unsupported("audio codec", codec);
+            if (body[1] == 0) return config(audio, body, 2);
+            return sample(audio, th.timestamp, 0, true, body, 2);
+        }
+        return !failed;
+    }
+
+    // remaining samples and mfra.
+    bool finish() {
+        for (Track *t : {&video, &audio}) {
+            if (t->samples.size() > 1) {
+                t->samples.back().duration = t->samples[t->samples.size() - 2].duration;
+            } else if (!t->samples.empty()) {
+                t->samples.back().duration = t->video ? 33 : 1024;
+            }
+        }
+        if (!flush(nullptr, true)) return false;
+        vector<BoxTFRA*> tfra;
+        for (Track *t : {&video, &audio}) {
+            if (t->tfra != nullptr) tfra.push_back(t->tfra);
+            t->tfra = nullptr;
+        }
+        if (tfra.empty()) return !failed;
+        ostringstream os;
+        write_mfra(os, tfra);
+        string s = os.str();
+        return out(s);
+    }
+
+    uint64_t size() const {return pos;}
+    uint32_t fragmentCount() const {return fragments;}
+
+private:
+    int fd;
+    Track video, audio;
+    bool initialized;
+    bool failed;
+    bool has_base;
+    uint32_t base_ms; // first media timestamp -> 0
+    uint32_t fragment_start_ms;
+    uint32_t sequence;
+    uint64_t pos;
+    uint32_t fragments;
+    vector<string> warned;
+
+    bool unsupported(const char *what, int codec) {
+        string w = string(what) + " " + to_string(codec);
+        if (find(warned.begin(), warned.end(), w) == warned.end()) {
+            cerr << "skip unsupported " << w << endl;
+            warned.push_back(w);
+        }
+        return !failed;
+    }
+
+    bool config(Track &t, const vector<uint8_t> &body, size_t skip) {
+        string c((const char*)&body[skip], body.size() - skip);
+        if (!t.config.empty()) {
+            if (c != t.config) cerr << "ignore " << (t.video ? "video" : "audio") << " config change" << endl;
+            return !failed;
+        }
+        bool ok = t.video ? avc_size(c, t.width, t.height) : aac_config(c, t.sample_rate, t.channels);
+        if (!ok) {
+            cerr << "bad " << (t.video ? "avcC" : "AudioSpecificConfig") << endl;
+            return !failed;
+        }
+        t.config = c;
+        if (!t.video) t.time_scale = t.sample_rate;
+        return !failed;
+    }
+
+    bool sample(Track &t, uint32_t ms, int32_t cts_ms, bool key, const vector<uint8_t> &body, size_t skip) {
+        if (t.config.empty() || (initialized && t.id == 0)) return !failed;
+        if (!has_base) {
+            has_base = true;
+            base_ms = ms;
+            fragment_start_ms = ms;
+        }
+        uint64_t dts = ms > base_ms ? (uint64_t)(ms - base_ms) * t.time_scale / 1000 : 0;
+        if (!t.samples.empty()) {
+            // ms timestamps: keep AAC frames contiguous unless there is a gap.
+            uint64_t expect = t.last_dts + 1024;
+            if (!t.video && dts + 512 >= expect && dts <= expect + 512) dts = expect;
+            dts = max(dts, t.last_dts);
+            t.samples.back().duration = dts - t.last_dts;
+        }
+
+        bool cut = t.video ? key : video.config.empty();
+        if (cut && ms >= fragment_start_ms && ms - fragment_start_ms >= fragment_ms) {
+            if (!flush(&t, false)) return false;
+            fragment_start_ms = ms;
+        }
+
+        if (t.samples.empty()) t.start_dts = dts;
+        t.last_dts = dts;
+        uint32_t n = body.size() - skip;
+        t.samples.push_back({0, n, (uint32_t)(key ? SAMPLE_FLAGS_SYNC : SAMPLE_FLAGS_NO_SYNC),
+                             (int32_t)((int64_t)cts_ms * t.time_scale / 1000)});
+        t.data.append((const char*)&body[skip], n);
+        return !failed;
+    }
+
+    bool out(const string &s) {
+        if (!failed && !write_fd(fd, s.data(), s.size())) failed = true;
+        pos += s.size();
+        return !failed;
+    }
+
+    bool init() {
+        initialized = true;
+        vector<Box*> tracks;
+        for (Track *t : {&video, &audio}) {
+            if (t->config.empty()) continue;
+            tracks.push_back(t->trak());
+            t->id = tracks.size();
+            t->tfra = new BoxTFRA();
+            t->tfra->track_id = t->id;
+        }
+        ostringstream os;
+        bool ok = !tracks.empty() && write_init_segment(os, tracks);
+        for (Box *b : tracks) delete b;
+        return ok ? out(os.str()) : !(failed = true);
+    }
+
+    // moof + mdat of the buffered samples. the last sample of a track other than complete
+    // (its duration is not known yet) stays for the next fragment. all: every sample.
+    bool flush(Track *complete, bool all) {
+        if (!initialized && !init()) return false;
+        Track *tracks[] = {&video, &audio};
+        size_t count[2] = {0, 0};
+        uint64_t bytes[2] = {0, 0};
+        uint64_t data_size = 0;
+        for (int i = 0; i < 2; i++) {
+            Track &t = *tracks[i];
+            if (t.id == 0 || t.samples.empty()) continue;
+            count[i] = all || &t == complete ? t.samples.size() : t.samples.size() - 1;
+            for (size_t s = 0; s < count[i]; s++) bytes[i] += t.samples[s].size;
+            data_size += bytes[i];
+        }
+        if (count[0] + count[1] == 0) return !failed;
+
+        Mp4Root root;
+        auto moof = root.adopt(new BoxSimpleList(BOX_MOOF));
+        auto mfhd = moof->adopt(new BoxMFHD());
+        mfhd->fragments = sequence++;
+        BoxTRUN *truns[2] = {nullptr, nullptr};
+        for (int i = 0; i < 2; i++) {
+            Track &t = *tracks[i];
+            if (count[i] == 0) continue;
+            auto traf = moof->adopt(new BoxSimpleList(BOX_TRAF));
+            auto tfhd = traf->adopt(new BoxTFHD());
+            tfhd->flags = BoxTFHD::FLAG_DEFAULT_BASE_IS_MOOF;
+            tfhd->track_id = t.id;
+            auto tfdt = traf->adopt(new BoxTFDT());
+            tfdt->flag_start = t.start_dts;
+            auto trun = traf->adopt(new BoxTRUN());
+            trun->flags = BoxTRUN::FLAG_DATA_OFFSET | BoxTRUN::FLAG_SAMPLE_DURATION | BoxTRUN::FLAG_SAMPLE_SIZE
+                | BoxTRUN::FLAG_SAMPLE_FLAGS | (t.video ? BoxTRUN::FLAG_SAMPLE_CTS : 0);
+            trun->data.reserve(count[i] * 4);
+            for (size_t s = 0; s < count[i]; s++) {
+                const Track::Entry &e = t.samples[s];
+                trun->add(e.duration);
+                trun->add(e.size);
+                trun->add(e.flags);
+                if (t.video) trun->add(e.cts);
+                if (e.cts < 0) trun->version = 1; // signed composition offsets
+            }
+            truns[i] = trun;
+            if (t.samples[0].flags == (uint32_t)SAMPLE_FLAGS_SYNC) t.tfra->add(t.start_dts + t.samples[0].cts, pos);
+        }
+
+        // mdat header, then the data of each traf in order.
+        uint8_t h[16];
+        ByteWriter mdat(h, sizeof(h));
+        if (data_size + 8 > UINT32_MAX) {
+            mdat.u32(1);
+            mdat.u32(BOX_MDAT);
+            mdat.u64(data_size + 16);
+        } else {
+            mdat.u32(data_size + 8);
+            mdat.u32(BOX_MDAT);
+        }
+        uint64_t offset = moof->calcSize() + mdat.size();
+        for (int i = 0; i < 2; i++) {
+            if (truns[i] == nullptr) continue;
+            truns[i]->data_offset = offset;
+            offset += bytes[i];
+        }
+        ostringstream os;
+        root.write(os);
+        string head = os.str();
+
+        struct iovec iov[4];
+        int n = 0;
+        iov[n++] = {(void*)head.data(), head.size()};
+        iov[n++] = {h, mdat.size()};
+        for (int i = 0; i < 2; i++) {
+            if (bytes[i] > 0) iov[n++] = {(void*)tracks[i]->data.data(), (size_t)bytes[i]};
+        }
+        if (!failed && !writev_fd(fd, iov, n)) failed = true;
+        pos += head.size() + mdat.size() + data_size;
+        fragments++;
+
+        for (int i = 0; i < 2; i++) {
+            Track &t = *tracks[i];
+            if (count[i] == 0) continue;
+            t.samples.erase(t.samples.begin(), t.samples.begin() + count[i]);
+            t.data.erase(0, bytes[i]);
+            if (!t.samples.empty()) t.start_dts = t.last_dts;
+        }
+        return !failed;
+    }
+};
+
+// usage: flvtomp4 [-f fragment_ms] in.flv out.mp4   ("-": stdin / stdout)
+int main(int argc, char *argv[]) {
+    uint32_t fragment_ms = 1000;
+    vector<string> files;
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        if (a == "-f" && i + 1 < argc) fragment_ms = max(0, atoi(argv[++i]));
+        else files.push_back(a);
+    }
+    if (files.size() != 2) {
+        cerr << "usage: flvtomp4 [-f fragment_ms] in.flv out.mp4" << endl;
+        return 1;
+    }
+
+    ifstream ifs(files[0] == "-" ? "/dev/stdin" : files[0], ios::binary);
+    flv::FLVHeader fh;
+    flv::parse(fh, ifs);
+    if (!ifs || memcmp(fh.signature, "FLV", 3) != 0) {
+        cerr << "not flv: " << files[0] << endl;
+        return 1;
+    }
+    ifs.ignore(fh.data_offset > 9 ? fh.data_offset - 9 : 0);
+    flv::read32(ifs); // PreviousTagSize0
+
+    int fd = files[1] == "-" ? 1 : open(files[1].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "can't open " << files[1] << endl;
+        return 1;
+    }
+    Remuxer remuxer(fd, fragment_ms);
+    flv::FLVTagHeader th;
+    vector<uint8_t> body;
+    uint64_t tags = 0;
+    for (;;) {
+        flv::parse(th, ifs);
+        if (!ifs || !flv::read_data(th, ifs, body)) break;
+        flv::read32(ifs); // PreviousTagSize
+        if (!remuxer.tag(th, body)) break;
+        tags++;
+    }
+    bool ok = remuxer.finish();
+    if (fd != 1) close(fd);
+    cerr << "tags: " << tags << " fragments: " << remuxer.fragmentCount() << " size: " << remuxer.size() << endl;
+    if (!ok) {
+        cerr << "write error" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -10,26 +10,82 @@
 #include <vector>
 #include <istream>
 #include <ostream>
+#include <streambuf>
 #include <string>
+#include <sstream>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ISOBMFF_X86_SIMD 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 namespace isobmff {
 
+// big endian load/store.
+static inline uint16_t be16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+static inline uint32_t be24(const uint8_t *p) {
+    return ((uint32_t)p[0] << 16) | (p[1] << 8) | p[2];
+}
+static inline uint32_t be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+static inline uint64_t be64(const uint8_t *p) {
+    return ((uint64_t)be32(p) << 32) | be32(p + 4);
+}
+static inline void put_be16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+static inline void put_be24(uint8_t *p, uint32_t v) {
+    p[0] = v >> 16;
+    p[1] = v >> 8;
+    p[2] = v;
+}
+static inline void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+static inline void put_be64(uint8_t *p, uint64_t v) {
+    put_be32(p, v >> 32);
+    put_be32(p + 4, v);
+}
+
 static inline uint32_t read32(std::istream &is) {
     uint8_t buf[4];
     is.read((char*)&buf[0],sizeof(buf));
-    return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+    return be32(buf);
 }
 
 static inline uint32_t read24(std::istream &is) {
     uint8_t buf[3];
     is.read((char*)&buf[0],sizeof(buf));
-    return (buf[0] << 16) | (buf[1] << 8) | buf[2];
+    return be24(buf);
 }
 static inline uint16_t read16(std::istream &is) {
     uint8_t buf[2];
     is.read((char*)&buf[0],sizeof(buf));
-    return (buf[1] << 8) | buf[0];
+    return be16(buf);
 }
 static inline uint8_t read8(std::istream &is) {
     uint8_t buf[1];
@@ -42,44 +98,603 @@ static inline uint64_t read64(std::istream &is) {
 }
 
 static inline void write8(std::ostream &is, uint8_t d) {
-    char buf[] = {d};
-    is.write(buf, sizeof(buf));
+    is.write((const char*)&d, 1);
 }
 static inline void write16(std::ostream &is, uint16_t d) {
-    char buf[] = {d >> 8, d};
-    is.write(buf, sizeof(buf));
+    uint8_t buf[2];
+    put_be16(buf, d);
+    is.write((const char*)buf, sizeof(buf));
 }
 static inline void write24(std::ostream &is, uint32_t d) {
-    char buf[] = {d >> 16, d >> 8, d};
-    is.write(buf, sizeof(buf));
+    uint8_t buf[3];
+    put_be24(buf, d);
+    is.write((const char*)buf, sizeof(buf));
 }
 static inline void write32(std::ostream &is, uint32_t d) {
-    char buf[] = {d >> 24, d >> 16, d >> 8, d};
-    is.write(buf, sizeof(buf));
+    uint8_t buf[4];
+    put_be32(buf, d);
+    is.write((const char*)buf, sizeof(buf));
 }
 static inline void write64(std::ostream &os, uint64_t d) {
-    write32(os, d >> 32);
-    write32(os, d);
+    uint8_t buf[8];
+    put_be64(buf, d);
+    os.write((const char*)buf, sizeof(buf));
+}
+
+// big endian reader over a byte block.
+// reading past the end sets fail() and yields zeros.
+class ByteReader {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool failed;
+
+    const uint8_t *take(size_t n) {
+        if ((size_t)(end - p) < n) {
+            failed = true;
+            p = end;
+            return nullptr;
+        }
+        const uint8_t *q = p;
+        p += n;
+        return q;
+    }
+public:
+    ByteReader(const uint8_t *data, size_t n) : p(data), end(data + n), failed(false) {}
+
+    bool fail() const {return failed;}
+    size_t remaining() const {return end - p;}
+    const uint8_t *current() const {return p;}
+
+    uint8_t u8() {const uint8_t *q = take(1); return q ? q[0] : 0;}
+    uint16_t u16() {const uint8_t *q = take(2); return q ? be16(q) : 0;}
+    uint32_t u24() {const uint8_t *q = take(3); return q ? be24(q) : 0;}
+    uint32_t u32() {const uint8_t *q = take(4); return q ? be32(q) : 0;}
+    uint64_t u64() {const uint8_t *q = take(8); return q ? be64(q) : 0;}
+    void skip(size_t n) {take(n);}
+
+    // copy n bytes. dst is zero filled on failure.
+    void read(void *dst, size_t n) {
+        const uint8_t *q = take(n);
+        if (q) memcpy(dst, q, n); else memset(dst, 0, n);
+    }
+    // refer to the next n bytes. nullptr on failure.
+    const uint8_t *bytes(size_t n) {return take(n);}
+};
+
+// big endian writer. appends to its own growable buffer, or fills a fixed one.
+// writing past the end of a fixed buffer sets fail() and writes nothing.
+class ByteWriter {
+    std::vector<uint8_t> own;
+    uint8_t *base;
+    size_t cap;
+    size_t pos;
+    bool growable;
+    bool failed;
+
+    uint8_t *take(size_t n) {
+        if (cap - pos < n) {
+            if (!growable) {
+                failed = true;
+                return nullptr;
+            }
+            own.resize(std::max(pos + n, cap * 2));
+            base = own.data();
+            cap = own.size();
+        }
+        uint8_t *q = base + pos;
+        pos += n;
+        return q;
+    }
+public:
+    explicit ByteWriter(size_t reserve = 0) : own(reserve), base(own.data()), cap(reserve), pos(0), growable(true), failed(false) {}
+    ByteWriter(uint8_t *p, size_t n) : base(p), cap(n), pos(0), growable(false), failed(false) {}
+    ByteWriter(const ByteWriter&) = delete;
+    ByteWriter& operator=(const ByteWriter&) = delete;
+
+    bool fail() const {return failed;}
+    size_t size() const {return pos;}
+    const uint8_t *data() const {return base;}
+
+    void u8(uint8_t v) {uint8_t *q = take(1); if (q) q[0] = v;}
+    void u16(uint16_t v) {uint8_t *q = take(2); if (q) put_be16(q, v);}
+    void u24(uint32_t v) {uint8_t *q = take(3); if (q) put_be24(q, v);}
+    void u32(uint32_t v) {uint8_t *q = take(4); if (q) put_be32(q, v);}
+    void u64(uint64_t v) {uint8_t *q = take(8); if (q) put_be64(q, v);}
+    void zero(size_t n) {uint8_t *q = take(n); if (q) memset(q, 0, n);}
+    void bytes(const void *src, size_t n) {
+        if (n == 0) return;
+        uint8_t *q = take(n);
+        if (q) memcpy(q, src, n);
+    }
+};
+
+// bulk table decode. big endian uint32 array -> native array.
+static inline void be32_decode_scalar(uint32_t *dst, const uint8_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] = be32(src + i * 4);
+}
+
+#ifdef ISOBMFF_X86_SIMD
+__attribute__((target("ssse3")))
+static inline void be32_decode_ssse3(uint32_t *dst, const uint8_t *src, size_t n) {
+    const __m128i m = _mm_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(v, m));
+    }
+    be32_decode_scalar(dst + i, src + i * 4, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline void be32_decode_avx2(uint32_t *dst, const uint8_t *src, size_t n) {
+    const __m256i m = _mm256_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+                                       3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i * 4 + 32));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(a, m));
+        _mm256_storeu_si256((__m256i*)(dst + i + 8), _mm256_shuffle_epi8(b, m));
+    }
+    be32_decode_scalar(dst + i, src + i * 4, n - i);
+}
+#endif
+
+// byte shuffle with AVX2/SSSE3 (x86, checked at run time) or NEON, scalar otherwise.
+static inline void be32_decode(uint32_t *dst, const uint8_t *src, size_t n) {
+#if defined(ISOBMFF_X86_SIMD)
+    static const int level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+    if (level == 2) return be32_decode_avx2(dst, src, n);
+    if (level == 1) return be32_decode_ssse3(dst, src, n);
+    be32_decode_scalar(dst, src, n);
+#elif defined(__ARM_NEON)
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_u32(dst + i, vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(src + i * 4))));
+    }
+    be32_decode_scalar(dst + i, src + i * 4, n - i);
+#else
+    be32_decode_scalar(dst, src, n);
+#endif
+}
+
+// exclusive prefix sum. dst[i] = start + src[0] + ... + src[i-1]. returns the total.
+// dst may not alias src.
+static inline uint64_t prefix_sum(uint64_t *dst, const uint32_t *src, size_t n, uint64_t start) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // two lanes per step: [0, a] + carry, then carry += a + b.
+    const __m128i zero = _mm_setzero_si128();
+    __m128i carry = _mm_set1_epi64x(start);
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_unpacklo_epi32(_mm_loadl_epi64((const __m128i*)(src + i)), zero);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi64(_mm_slli_si128(v, 8), carry));
+        carry = _mm_add_epi64(carry, _mm_add_epi64(v, _mm_shuffle_epi32(v, 0x4e)));
+    }
+    _mm_storel_epi64((__m128i*)&start, carry);
+#endif
+    for (; i < n; i++) {
+        dst[i] = start;
+        start += src[i];
+    }
+    return start;
+}
+
+// sequential reader of a big endian uint32 table with entries of stride values.
+// decoded a block at a time, no copy of the whole table is made.
+class TableReader {
+    static const size_t BLOCK = 1536; // multiple of 1, 2, 3
+    const uint8_t *p;
+    size_t left; // entries
+    size_t stride;
+    uint32_t block[BLOCK];
+public:
+    TableReader(const uint8_t *p, size_t entries, size_t stride = 1) : p(p), left(entries), stride(stride) {}
+
+    size_t remaining() const {return left;}
+    // next block of whole entries. returns the number of entries, 0 at the end.
+    size_t next(const uint32_t *&v) {
+        size_t n = std::min(left, BLOCK / stride);
+        be32_decode(block, p, n * stride);
+        p += n * stride * 4;
+        left -= n;
+        v = block;
+        return n;
+    }
+};
+
+// four character code. "moov"_4cc == fourcc("moov")
+constexpr uint32_t fourcc(const char *s) {
+    return ((uint32_t)(uint8_t)s[0] << 24) | ((uint32_t)(uint8_t)s[1] << 16) | ((uint32_t)(uint8_t)s[2] << 8) | (uint8_t)s[3];
+}
+constexpr uint32_t operator""_4cc(const char *s, size_t) {
+    return fourcc(s);
+}
+static inline std::string fourcc_string(uint32_t t) {
+    char s[5] = {(char)(t >> 24), (char)(t >> 16), (char)(t >> 8), (char)t, '\0'};
+    return std::string(s);
+}
+
+// read-only memory mapped file.
+class MappedFile {
+    int fd;
+    const uint8_t *addr;
+    size_t len;
+public:
+    MappedFile() : fd(-1), addr(nullptr), len(0) {}
+    explicit MappedFile(const char *path) : MappedFile() { open(path); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const char *path) {
+        close();
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close();
+            return false;
+        }
+        void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close();
+            return false;
+        }
+        addr = (const uint8_t*)p;
+        len = st.st_size;
+        return true;
+    }
+    void close() {
+        if (addr != nullptr) ::munmap((void*)addr, len);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        addr = nullptr;
+        len = 0;
+    }
+    bool is_open() const {return addr != nullptr;}
+    const uint8_t *data() const {return addr;}
+    size_t size() const {return len;}
+    int handle() const {return fd;}
+};
+
+static inline bool write_fd(int fd, const void *p, size_t n) {
+    const char *c = (const char*)p;
+    while (n > 0) {
+        ssize_t w = ::write(fd, c, n);
+        if (w <= 0) return false;
+        c += w;
+        n -= w;
+    }
+    return true;
+}
+
+// ostream buffer writing to a file descriptor.
+// boxes copy file ranges to fd() in kernel after a flush. (UnknownBoxRef)
+class FdStreamBuf : public std::streambuf {
+    int file;
+    bool own;
+    std::vector<char> buf;
+public:
+    explicit FdStreamBuf(int fd, bool own = false, size_t bufsize = 1 << 16) : file(fd), own(own), buf(bufsize) {
+        setp(buf.data(), buf.data() + buf.size());
+    }
+    explicit FdStreamBuf(const char *path, size_t bufsize = 1 << 16)
+        : FdStreamBuf(::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644), true, bufsize) {}
+    FdStreamBuf(const FdStreamBuf&) = delete;
+    FdStreamBuf& operator=(const FdStreamBuf&) = delete;
+    ~FdStreamBuf() {
+        sync();
+        if (own && file >= 0) ::close(file);
+    }
+    bool is_open() const {return file >= 0;}
+    int fd() const {return file;}
+
+protected:
+    int sync() {
+        size_t n = pptr() - pbase();
+        setp(buf.data(), buf.data() + buf.size());
+        return n == 0 || write_fd(file, buf.data(), n) ? 0 : -1;
+    }
+    int_type overflow(int_type c) {
+        if (sync() != 0) return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) {
+        if ((size_t)n < buf.size()) return std::streambuf::xsputn(s, n);
+        // large block: no copy into the buffer.
+        if (sync() != 0 || !write_fd(file, s, n)) return 0;
+        return n;
+    }
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) {
+        if (off == 0 && dir == std::ios_base::cur) { // tellp
+            off_t p = ::lseek(file, 0, SEEK_CUR);
+            return p < 0 ? pos_type(off_type(-1)) : pos_type(p + (pptr() - pbase()));
+        }
+        if (sync() != 0) return pos_type(off_type(-1));
+        off_t p = ::lseek(file, off, dir == std::ios_base::beg ? SEEK_SET : dir == std::ios_base::cur ? SEEK_CUR : SEEK_END);
+        return p < 0 ? pos_type(off_type(-1)) : pos_type(p);
+    }
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
+
+// copy len bytes at offset of in_fd to the current position of out_fd.
+// in kernel (copy_file_range, then sendfile) if possible, read/write otherwise.
+static inline bool copy_fd_range(int out_fd, int in_fd, uint64_t offset, uint64_t len) {
+#ifdef __linux__
+    while (len > 0) {
+        loff_t o = offset;
+        ssize_t n = ::copy_file_range(in_fd, &o, out_fd, nullptr, len, 0);
+        if (n <= 0) break;
+        offset += n;
+        len -= n;
+    }
+    while (len > 0) {
+        off_t o = offset;
+        ssize_t n = ::sendfile(out_fd, in_fd, &o, std::min<uint64_t>(len, 1 << 30));
+        if (n <= 0) break;
+        offset += n;
+        len -= n;
+    }
+#endif
+    std::vector<char> buf(len > 0 ? 1 << 20 : 0);
+    while (len > 0) {
+        ssize_t n = ::pread(in_fd, buf.data(), std::min<uint64_t>(len, buf.size()), offset);
+        if (n <= 0 || !write_fd(out_fd, buf.data(), n)) return false;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+// copy len bytes at offset of is to os through a large buffer.
+static inline bool copy_stream_range(std::ostream &os, std::istream &is, uint64_t offset, uint64_t len) {
+    is.clear();
+    is.seekg(offset, std::ios_base::beg);
+    std::vector<char> buf(std::min<uint64_t>(len, 1 << 20));
+    while (len > 0 && is) {
+        size_t n = std::min<uint64_t>(len, buf.size());
+        is.read(buf.data(), n);
+        os.write(buf.data(), is.gcount());
+        len -= is.gcount();
+    }
+    return len == 0 && os.good();
 }
 
+// istream buffer over memory. no copy, seek is pointer arithmetic.
+class MemoryStreamBuf : public std::streambuf {
+    bool persistent;
+    int file;
+public:
+    // persistent: the memory outlives the parsed boxes, so they may refer to it.
+    // fd: the file mapped at p, if any.
+    MemoryStreamBuf(const uint8_t *p, size_t n, bool persistent = true, int fd = -1) : persistent(persistent), file(fd) {
+        char *b = (char*)p;
+        setg(b, b, b + n);
+    }
+    bool isPersistent() const {return persistent;}
+    const uint8_t *base() const {return (const uint8_t*)eback();}
+    int fd() const {return file;}
+
+    // returns pointer to next n bytes and advances, or nullptr.
+    // transient: the caller does not keep the pointer, so any memory will do.
+    const uint8_t *view(size_t n, bool transient = false) {
+        if ((!persistent && !transient) || (size_t)(egptr() - gptr()) < n) return nullptr;
+        char *p = gptr();
+        setg(eback(), p + n, egptr());
+        return (const uint8_t*)p;
+    }
+
+protected:
+    std::streamsize xsgetn(char *s, std::streamsize n) {
+        std::streamsize avail = egptr() - gptr();
+        if (n > avail) n = avail;
+        memcpy(s, gptr(), n);
+        setg(eback(), gptr() + n, egptr());
+        return n;
+    }
+    std::streamsize showmanyc() {
+        return egptr() - gptr();
+    }
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) {
+        if (dir == std::ios_base::cur) off += gptr() - eback();
+        else if (dir == std::ios_base::end) off += egptr() - eback();
+        if (off < 0 || off > egptr() - eback()) return pos_type(off_type(-1));
+        setg(eback(), eback() + off, egptr());
+        return pos_type(off);
+    }
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
+
+// zero-copy read if the stream is backed by memory. nullptr otherwise.
+static inline const uint8_t *stream_view(std::istream &is, size_t n, bool transient = false) {
+    MemoryStreamBuf *sb = dynamic_cast<MemoryStreamBuf*>(is.rdbuf());
+    if (sb == nullptr || !is.good()) return nullptr;
+    return sb->view(n, transient);
+}
+
+// memory resource for new boxes and their tables on this thread.
+inline std::pmr::memory_resource *&box_memory_resource() {
+    static thread_local std::pmr::memory_resource *mr = std::pmr::new_delete_resource();
+    return mr;
+}
+
+// allocate boxes from mr while in scope.
+// e.g. std::pmr::monotonic_buffer_resource arena; { BoxAllocScope s(&arena); ... }
+class BoxAllocScope {
+    std::pmr::memory_resource *prev;
+public:
+    explicit BoxAllocScope(std::pmr::memory_resource *mr) : prev(box_memory_resource()) {
+        box_memory_resource() = mr;
+    }
+    ~BoxAllocScope() { box_memory_resource() = prev; }
+    BoxAllocScope(const BoxAllocScope&) = delete;
+    BoxAllocScope& operator=(const BoxAllocScope&) = delete;
+};
+
+// byte array, owns its bytes or refers to external memory (e.g. MappedFile).
+// modification copies a referred array into own storage first.
+class ByteBuf {
+    mutable std::pmr::vector<uint8_t> own;
+    mutable const uint8_t *ptr;
+    size_t len;
+
+    void materialize() const {
+        if (ptr == nullptr && len > 0) {
+            own.resize(len);
+            ptr = own.data();
+        }
+    }
+    void detach() {
+        materialize();
+        if (len > 0 && ptr != own.data()) {
+            own.assign(ptr, ptr + len);
+            ptr = own.data();
+        }
+    }
+public:
+    ByteBuf() : own(box_memory_resource()), ptr(nullptr), len(0) {}
+    explicit ByteBuf(size_t n) : own(box_memory_resource()), ptr(nullptr), len(n) {} // zero filled on first access.
+    ByteBuf(const ByteBuf &b) : own(box_memory_resource()), ptr(nullptr), len(0) {*this = b;}
+    ByteBuf& operator=(const ByteBuf &b) {
+        if (this == &b) return *this;
+        if (b.isView()) {
+            own.clear();
+            ptr = b.ptr;
+            len = b.len;
+        } else {
+            b.materialize();
+            own = b.own;
+            len = b.len;
+            ptr = len > 0 ? own.data() : nullptr;
+        }
+        return *this;
+    }
+
+    bool isView() const {return ptr != nullptr && ptr != own.data();}
+    size_t size() const {return len;}
+    bool empty() const {return len == 0;}
+
+    const uint8_t *data() const {materialize(); return ptr;}
+    uint8_t *data() {detach(); return own.data();}
+    const uint8_t &operator[](size_t i) const {materialize(); return ptr[i];}
+    uint8_t &operator[](size_t i) {detach(); return own[i];}
+    const uint8_t *begin() const {return data();}
+    const uint8_t *end() const {return data() + len;}
+
+    // refer to p without copy. p must outlive this.
+    void view(const uint8_t *p, size_t n) {
+        own.clear();
+        own.shrink_to_fit();
+        ptr = p;
+        len = n;
+    }
+    void assign(const uint8_t *p, size_t n) {
+        own.assign(p, p + n);
+        ptr = own.data();
+        len = n;
+    }
+    void append(const uint8_t *p, size_t n) {
+        detach();
+        own.insert(own.end(), p, p + n);
+        ptr = own.data();
+        len = own.size();
+    }
+    void resize(size_t n) {
+        detach();
+        own.resize(n);
+        ptr = own.data();
+        len = n;
+    }
+
+    // fill from stream. refer to the stream memory if possible.
+    void read(std::istream &is, size_t n) {
+        const uint8_t *p = stream_view(is, n);
+        if (p != nullptr) {
+            view(p, n);
+            return;
+        }
+        own.resize(n);
+        ptr = own.data();
+        len = n;
+        if (n > 0) is.read((char*)&own[0], n);
+    }
+};
+
 
 class Box{
+    struct AllocHeader {
+        std::pmr::memory_resource *mr;
+        size_t size;
+    };
+    static const size_t ALLOC_HEADER_SIZE =
+        (sizeof(AllocHeader) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
 public:
     size_t size;
-    char type[5];
-    std::vector<Box*> children;
+    uint32_t type;
+    std::pmr::vector<Box*> children;
     int ref_count;
-
-    Box(const char boxtype[4], size_t sz){
-        memcpy(type, boxtype, 4);
-        type[4] = '\0';
+    uint64_t body_offset; // stream position of the payload.
+    std::istream *source; // not null while the payload is not decoded yet. (lazy parse)
+    bool largesize; // 64bit size field. (16 byte header)
+
+    // boxes come from box_memory_resource() and go back to the resource they came from,
+    // so a box can be shared (ref_count) with a tree using another resource.
+    static void *operator new(size_t sz) {
+        std::pmr::memory_resource *mr = box_memory_resource();
+        size_t total = ALLOC_HEADER_SIZE + sz;
+        AllocHeader *h = (AllocHeader*)mr->allocate(total, alignof(std::max_align_t));
+        h->mr = mr;
+        h->size = total;
+        return (char*)h + ALLOC_HEADER_SIZE;
+    }
+    static void operator delete(void *p) {
+        if (p == nullptr) return;
+        AllocHeader *h = (AllocHeader*)((char*)p - ALLOC_HEADER_SIZE);
+        h->mr->deallocate(h, h->size, alignof(std::max_align_t));
+    }
+
+    Box(uint32_t boxtype, size_t sz, std::pmr::memory_resource *mr = box_memory_resource()) : children(mr) {
+        type = boxtype;
         size = sz;
         ref_count = 1;
+        body_offset = 0;
+        source = nullptr;
+        largesize = false;
     }
     virtual bool is_full_box() const {return false;}
 
-    Box* findByType(const char n[4]) {
-        if (memcmp(type, n, 4)==0) return this;
+    size_t headerSize() const {return largesize ? 16 : 8;}
+    // box size for the payload size. switches to a 64bit size field if it does not fit 32bit.
+    size_t sizeFor(size_t payload) {
+        if (payload + 8 > UINT32_MAX) largesize = true;
+        return payload + headerSize();
+    }
+
+    bool loaded() const {return source == nullptr;}
+    std::string typeName() const {return fourcc_string(type);}
+
+    // decode the payload of a lazily parsed box.
+    Box* load() {
+        if (source == nullptr) return this;
+        std::istream &is = *source;
+        source = nullptr;
+        is.clear();
+        is.seekg(body_offset, std::ios_base::beg);
+        parse(is);
+        return this;
+    }
+
+    Box* findByType(uint32_t n) {
+        if (type == n) return load();
         for (int i=0; i<children.size(); i++) {
             Box *b = children[i]->findByType(n);
             if (b != nullptr) return b;
@@ -87,17 +702,53 @@ public:
         return nullptr;
     }
 
+    Box* findByType(const char n[4]) {return findByType(fourcc(n));}
+
+    // path query. e.g. find<BoxSTSZ>("moov/trak[1]/mdia/minf/stbl/stsz")
+    // [n]: n-th (0 origin) child of the type. default 0.
+    // returns nullptr if not found or the box is not a T.
+    template<typename T = Box>
+    T* find(const std::string &path) {
+        Box *b = this;
+        size_t p = 0;
+        while (b != nullptr && p < path.size()) {
+            size_t q = path.find('/', p);
+            if (q == std::string::npos) q = path.size();
+            size_t br = path.find('[', p);
+            uint32_t nth = 0;
+            if (br < q) {
+                nth = strtoul(path.c_str() + br + 1, nullptr, 10);
+            } else {
+                br = q;
+            }
+            char name[5] = "    ";
+            memcpy(name, path.c_str() + p, std::min<size_t>(br - p, 4));
+            b = b->child(fourcc(name), nth);
+            p = q + 1;
+        }
+        return b == nullptr ? nullptr : dynamic_cast<T*>(b->load());
+    }
+
+    // n-th direct child of the type.
+    Box* child(uint32_t t, uint32_t nth = 0) const {
+        for (auto c : children) {
+            if (c->type == t && nth-- == 0) return c;
+        }
+        return nullptr;
+    }
+
     template<typename T>
-    std::vector<T*>& findAllByType(std::vector<T*> &out, const char n[4]) {
-        if (memcmp(type, n, 4)==0)
-            out.push_back((T*)this);
+    std::vector<T*>& findAllByType(std::vector<T*> &out, uint32_t n) {
+        if (type == n)
+            out.push_back((T*)load());
         for (int i=0; i<children.size(); i++)
             children[i]->findAllByType(out, n);
         return out;
     }
 
     void dump(std::ostream &os, const std::string &prefix) const {
-        os << prefix << type;
+        const_cast<Box*>(this)->load();
+        os << prefix << typeName().c_str();
         os << " size: " << size << std::endl;
         dump_attr(os, prefix);
         for (int i=0; i<children.size(); i++) {
@@ -106,17 +757,58 @@ public:
     }
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {}
 
-    virtual void parse(std::istream &is) {}
+    // reads the payload in one block (or refers to it if the stream is in memory) and decode()s it.
+    virtual void parse(std::istream &is) {
+        size_t n = size > headerSize() ? size - headerSize() : 0;
+        const uint8_t *p = stream_view(is, n, true);
+        uint8_t small[256];
+        std::vector<uint8_t> large;
+        if (p == nullptr) {
+            uint8_t *d = small;
+            if (n > sizeof(small)) {
+                large.resize(n);
+                d = large.data();
+            }
+            if (n > 0) is.read((char*)d, n);
+            n = is.gcount();
+            p = d;
+        }
+        ByteReader r(p, n);
+        decode(r);
+    }
+    // payload without the header and children.
+    virtual void decode(ByteReader &r) {}
+    virtual void encode(ByteWriter &w) const {}
 
     virtual size_t calcSize() {return size;}
 
+    // header and payload in one write, then the children.
     virtual void write(std::ostream &os) const {
-        write32(os, size);
-        os.write(type, 4);
+        ByteWriter w(children.empty() ? size : headerSize());
+        encodeHeader(w);
+        encode(w);
+        os.write((const char*)w.data(), w.size());
         for (int i=0; i<children.size(); i++) {
             children[i]->write(os);
         }
     }
+    void encodeHeader(ByteWriter &w) const {
+        if (largesize) {
+            w.u32(1);
+            w.u32(type);
+            w.u64(size);
+        } else {
+            w.u32(size);
+            w.u32(type);
+        }
+    }
+    // size and type only. for boxes writing a large payload directly.
+    void writeHeader(std::ostream &os) const {
+        uint8_t h[16];
+        ByteWriter w(h, sizeof(h));
+        encodeHeader(w);
+        os.write((const char*)h, w.size());
+    }
 
     virtual ~Box() {
         for (auto &b :children) {
@@ -128,19 +820,18 @@ public:
 
 class FullBox : public Box {
 public:
-    FullBox(const char boxtype[4], size_t sz) : Box(boxtype, sz), version(0), flags(0) {};
+    FullBox(uint32_t boxtype, size_t sz) : Box(boxtype, sz), version(0), flags(0) {};
     uint8_t version;
     uint32_t flags;
     bool is_full_box() const {return true;}
 
-    void parse(std::istream &is) {
-        version = read8(is);
-        flags = read24(is);
+    void decode(ByteReader &r) {
+        version = r.u8();
+        flags = r.u24();
     }
-    virtual void write(std::ostream &os) const {
-        Box::write(os);
-        write8(os, version);
-        write24(os, flags);
+    void encode(ByteWriter &w) const {
+        w.u8(version);
+        w.u24(flags);
     }
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
         os << prefix << " v" << version << " flags:" << flags << std::endl;
@@ -153,34 +844,37 @@ protected:
 
 class FullBufBox : public FullBox{
 protected:
-    std::vector<uint8_t> buf;
+    ByteBuf buf;
     uint8_t ui8(int pos) const {
         return buf[pos];
     }
     uint16_t ui16(int pos) const {
-        return (buf[pos] << 8)|buf[pos+1];
+        return be16(buf.data() + pos);
     }
     uint32_t ui32(int pos) const {
-        return (buf[pos] << 24)|(buf[pos+1] << 16)|(buf[pos+2] << 8)|buf[pos+3];
+        return be32(buf.data() + pos);
     }
     uint64_t ui64(int pos) const {
-        uint64_t h = ui32(pos);
-        return h | ui32(pos+4);
+        return be64(buf.data() + pos);
     }
     void ui16(int pos, uint16_t v) {
-        buf[pos+0] = v >> 8;
-        buf[pos+1] = v;
+        put_be16(buf.data() + pos, v);
     }
     void ui32(int pos, uint32_t v) {
-        buf[pos+0] = v >> 24;
-        buf[pos+1] = v >> 16;
-        buf[pos+2] = v >> 8;
-        buf[pos+3] = v;
+        put_be32(buf.data() + pos, v);
     }
-public:
-    FullBufBox(const char type[4], size_t sz) : FullBox(type, sz) {
-        buf.resize(sz - HEADER_SIZE);
+    void ui64(int pos, uint64_t v) {
+        put_be64(buf.data() + pos, v);
+    }
+    // n entries of stride values from pos, clamped to the buffer.
+    size_t ui32s(size_t pos, size_t n, size_t stride = 1) const {
+        return std::min(n, buf.size() > pos ? (buf.size() - pos) / 4 / stride : 0);
+    }
+    TableReader table(size_t pos, size_t n, size_t stride = 1) const {
+        return TableReader(buf.data() + pos, ui32s(pos, n, stride), stride);
     }
+public:
+    FullBufBox(uint32_t boxtype, size_t sz) : FullBox(boxtype, sz), buf(sz - HEADER_SIZE) {}
 
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
         os << prefix << " : [";
@@ -190,24 +884,42 @@ public:
         os << "...] " << buf.size() << std::endl;
     }
 
+    // the table is not copied into a block but referred to (mapped file) or read directly.
     void parse(std::istream &is) {
-        FullBox::parse(is);
-        is.read((char*)&buf[0], size - HEADER_SIZE);
+        uint8_t h[4];
+        is.read((char*)h, sizeof(h));
+        ByteReader r(h, sizeof(h));
+        FullBox::decode(r);
+        buf.read(is, size - headerSize() - 4);
+    }
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        size_t n = r.remaining();
+        buf.assign(r.bytes(n), n);
+    }
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        w.bytes(buf.data(), buf.size());
     }
     virtual void write(std::ostream &os) const {
-        FullBox::write(os);
-        if (size > 8) {
-            os.write((char*)&buf[0], buf.size());
+        uint8_t h[HEADER_SIZE + 8];
+        ByteWriter w(h, sizeof(h));
+        encodeHeader(w);
+        FullBox::encode(w);
+        os.write((const char*)h, w.size());
+        if (buf.size() > 0) {
+            os.write((const char*)buf.data(), buf.size());
         }
     }
 
-    virtual size_t calcSize() {size = buf.size()+HEADER_SIZE; return size;}
+    virtual size_t calcSize() {size = sizeFor(buf.size() + 4); return size;}
 };
 
 class UnknownBox : public Box {
 public:
-    std::vector<uint8_t> buf;
-    UnknownBox(const char boxtype[4], size_t sz) : Box(boxtype, sz) { buf.resize(sz-8); }
+    ByteBuf buf;
+    UnknownBox(uint32_t boxtype, size_t sz) : Box(boxtype, sz), buf(sz-8) {}
+    UnknownBox(const char boxtype[4], size_t sz) : UnknownBox(fourcc(boxtype), sz) {}
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
         os << prefix << " unknown_body: [";
         for (int i=0; i<10 && i < buf.size(); i++) {
@@ -217,22 +929,36 @@ public:
     }
 
     void parse(std::istream &is) {
-        is.read((char*)&buf[0], size - 8);
+        buf.read(is, size - headerSize());
+    }
+    void decode(ByteReader &r) {
+        size_t n = r.remaining();
+        buf.assign(r.bytes(n), n);
+    }
+    void encode(ByteWriter &w) const {
+        w.bytes(buf.data(), buf.size());
     }
     virtual void write(std::ostream &os) const {
-        Box::write(os);
+        writeHeader(os);
         if (buf.size() > 0) {
-            os.write((char*)&buf[0], buf.size());
+            os.write((const char*)buf.data(), buf.size());
         }
     }
 
-    virtual size_t calcSize() {size = buf.size()+8; return size;}
+    virtual size_t calcSize() {size = sizeFor(buf.size()); return size;}
 };
 
+// large box (mdat, mostly) not read into memory. write() copies the payload
+// from the source: in kernel to a FdStreamBuf if the source is a mapped file,
+// from the mapping, or through a buffer from the source stream.
+// the source (stream or Mp4Root of the mapped file) must outlive the box.
 class UnknownBoxRef : public Box {
 public:
-    UnknownBoxRef(const char boxtype[4], size_t sz) : Box(boxtype, sz) {}
+    UnknownBoxRef(uint32_t boxtype, size_t sz) : Box(boxtype, sz), offset(0), stream(nullptr), data(nullptr), fd(-1) {}
     long long offset;
+    std::istream *stream;
+    const uint8_t *data; // payload in the mapping.
+    int fd;              // the mapped file.
 
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
         os << prefix << " unknown_ref: " << offset << std::endl;
@@ -240,62 +966,78 @@ public:
 
     void parse(std::istream &is) {
         offset = is.tellg();
+        stream = &is;
+        MemoryStreamBuf *sb = dynamic_cast<MemoryStreamBuf*>(is.rdbuf());
+        if (sb != nullptr && sb->isPersistent()) {
+            data = sb->base() + offset;
+            fd = sb->fd();
+        }
         size_t pos = offset;
-        is.seekg(pos + size - 8, std::ios_base::beg);
+        is.seekg(pos + size - headerSize(), std::ios_base::beg);
     }
 
     virtual void write(std::ostream &os) const {
-        // TODO:
+        uint64_t len = size - headerSize();
+        writeHeader(os);
+        FdStreamBuf *out = dynamic_cast<FdStreamBuf*>(os.rdbuf());
+        if (fd >= 0 && out != nullptr && os.flush()) {
+            if (!copy_fd_range(out->fd(), fd, offset, len)) os.setstate(std::ios_base::badbit);
+        } else if (data != nullptr) {
+            os.write((const char*)data, len);
+        } else if (stream != nullptr) {
+            if (!copy_stream_range(os, *stream, offset, len)) os.setstate(std::ios_base::badbit);
+        } else {
+            os.setstate(std::ios_base::failbit); // payload is not available. (push parser)
+        }
     }
-
 };
 
 
 // mp4
-static const char *BOX_FTYP = "ftyp";
-static const char *BOX_FREE = "free";
-static const char *BOX_MOOV = "moov";
-static const char *BOX_MVHD = "mvhd";
-static const char *BOX_MDIA = "mdia";
-static const char *BOX_MDHD = "mdhd";
-static const char *BOX_MINF = "minf";
-static const char *BOX_MDAT = "mdat";
-static const char *BOX_HDLR = "hdlr";
-static const char *BOX_STCO = "stco";
-static const char *BOX_STSC = "stsc";
-static const char *BOX_STSD = "stsd";
-static const char *BOX_STTS = "stts";
-static const char *BOX_STSZ = "stsz";
-static const char *BOX_STSS = "stss";
-static const char *BOX_STBL = "stbl";
-static const char *BOX_CTTS = "ctts";
-static const char *BOX_TRAK = "trak";
-static const char *BOX_TKHD = "tkhd";
-static const char *BOX_DTS  = "dts\0";
-static const char *BOX_UDTA = "udta";
-
-static const char *BOX_STYP = "styp";
-static const char *BOX_MOOF = "moof";
-static const char *BOX_MFHD = "mfhd";
-static const char *BOX_TRAF = "traf";
-static const char *BOX_TFHD = "tfhd";
-static const char *BOX_TFDT = "tfdt";
-static const char *BOX_TRUN = "trun";
-static const char *BOX_TREX = "trex";
-static const char *BOX_SIDX = "sidx";
-static const char *BOX_PSSH = "pssh";
+static constexpr uint32_t BOX_FTYP = "ftyp"_4cc;
+static constexpr uint32_t BOX_FREE = "free"_4cc;
+static constexpr uint32_t BOX_MOOV = "moov"_4cc;
+static constexpr uint32_t BOX_MVHD = "mvhd"_4cc;
+static constexpr uint32_t BOX_MDIA = "mdia"_4cc;
+static constexpr uint32_t BOX_MDHD = "mdhd"_4cc;
+static constexpr uint32_t BOX_MINF = "minf"_4cc;
+static constexpr uint32_t BOX_MDAT = "mdat"_4cc;
+static constexpr uint32_t BOX_HDLR = "hdlr"_4cc;
+static constexpr uint32_t BOX_STCO = "stco"_4cc;
+static constexpr uint32_t BOX_CO64 = "co64"_4cc;
+static constexpr uint32_t BOX_STSC = "stsc"_4cc;
+static constexpr uint32_t BOX_STSD = "stsd"_4cc;
+static constexpr uint32_t BOX_STTS = "stts"_4cc;
+static constexpr uint32_t BOX_STSZ = "stsz"_4cc;
+static constexpr uint32_t BOX_STSS = "stss"_4cc;
+static constexpr uint32_t BOX_STBL = "stbl"_4cc;
+static constexpr uint32_t BOX_CTTS = "ctts"_4cc;
+static constexpr uint32_t BOX_TRAK = "trak"_4cc;
+static constexpr uint32_t BOX_TKHD = "tkhd"_4cc;
+static constexpr uint32_t BOX_DTS  = "dts\0"_4cc;
+static constexpr uint32_t BOX_UDTA = "udta"_4cc;
+
+static constexpr uint32_t BOX_STYP = "styp"_4cc;
+static constexpr uint32_t BOX_MOOF = "moof"_4cc;
+static constexpr uint32_t BOX_MFHD = "mfhd"_4cc;
+static constexpr uint32_t BOX_TRAF = "traf"_4cc;
+static constexpr uint32_t BOX_TFHD = "tfhd"_4cc;
+static constexpr uint32_t BOX_TFDT = "tfdt"_4cc;
+static constexpr uint32_t BOX_TRUN = "trun"_4cc;
+static constexpr uint32_t BOX_MVEX = "mvex"_4cc;
+static constexpr uint32_t BOX_TREX = "trex"_4cc;
+static constexpr uint32_t BOX_SIDX = "sidx"_4cc;
+static constexpr uint32_t BOX_PSSH = "pssh"_4cc;
+static constexpr uint32_t BOX_MFRA = "mfra"_4cc;
+static constexpr uint32_t BOX_TFRA = "tfra"_4cc;
+static constexpr uint32_t BOX_MFRO = "mfro"_4cc;
 
 static const int SAMPLE_FLAGS_NO_SYNC = 0x01010000;
 static const int SAMPLE_FLAGS_SYNC = 0x02000000;
 
-static const char* HAS_CHILD_BOX[] = {BOX_MOOV, BOX_TRAK, BOX_DTS, BOX_MDIA, BOX_MINF, BOX_STBL, BOX_UDTA, BOX_MOOF, BOX_TRAF, "edts"};
+static constexpr uint32_t HAS_CHILD_BOX[] = {BOX_MOOV, BOX_TRAK, BOX_DTS, BOX_MDIA, BOX_MINF, BOX_STBL, BOX_UDTA, BOX_MOOF, BOX_TRAF, BOX_MFRA, BOX_MVEX, "edts"_4cc};
 
-bool has_child(const char type[4]){
-    for (auto b : HAS_CHILD_BOX) {
-        if (memcmp(type, b, 4) == 0) return true;
-    }
-    return false;
-}
+static inline bool has_child(uint32_t type);
 
 class BoxFTYP : public Box{
 public:
@@ -306,36 +1048,30 @@ public:
     std::vector<uint32_t> compat;
 
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
-        os << prefix << " major: " << major << std::endl;
+        os << prefix << " major: " << std::string(major, 4) << std::endl;
         os << prefix << " minor: " << minor << std::endl;
     }
 
-    void parse(std::istream &is) {
-        is.read(major, 4);
-        minor = read32(is);
-        for (int i=0; i<(size-16)/4; i++) {
-            uint32_t b;
-            is.read((char*)&b, 4);
-            compat.push_back(b);
-        }
+    void decode(ByteReader &r) {
+        r.read(major, 4);
+        minor = r.u32();
+        compat.resize(r.remaining() / 4);
+        r.read(compat.data(), compat.size() * 4);
     }
 
     virtual size_t calcSize() {size = compat.size()*4 +16; return size;}
 
-    virtual void write(std::ostream &os) const {
-        Box::write(os);
-        os.write(major, 4);
-        write32(os, minor);
-        os.write((char*)&compat[0], compat.size()*4);
+    void encode(ByteWriter &w) const {
+        w.bytes(major, 4);
+        w.u32(minor);
+        w.bytes(compat.data(), compat.size()*4);
     }
 };
 
 class BoxFREE : public Box{
 public:
-    BoxFREE(size_t sz) : Box(BOX_FREE, sz) {
-        body.resize(sz - 8);
-    }
-    std::vector<uint8_t> body;
+    BoxFREE(size_t sz) : Box(BOX_FREE, sz), body(sz - 8) {}
+    ByteBuf body;
 
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
         os << prefix << " body: [";
@@ -346,12 +1082,19 @@ public:
     }
 
     void parse(std::istream &is) {
-        is.read((char*)&body[0], size - 8);
+        body.read(is, size - headerSize());
+    }
+    void decode(ByteReader &r) {
+        size_t n = r.remaining();
+        body.assign(r.bytes(n), n);
+    }
+    void encode(ByteWriter &w) const {
+        w.bytes(body.data(), body.size());
     }
     virtual void write(std::ostream &os) const {
-        Box::write(os);
-        if (size > 8) {
-            os.write((char*)&body[0], size - 8);
+        writeHeader(os);
+        if (body.size() > 0) {
+            os.write((const char*)body.data(), body.size());
         }
     }
 };
@@ -360,8 +1103,8 @@ public:
 class BoxMVHD : public FullBox{
 public:
     BoxMVHD(size_t sz = HEADER_SIZE + 24 * 4) : FullBox(BOX_MVHD, sz) {}
-    uint32_t created;
-    uint32_t modified;
+    uint64_t created;
+    uint64_t modified;
     uint32_t timeScale;
     uint64_t duration;
     uint32_t rate;
@@ -381,38 +1124,54 @@ public:
         matrix[8] = 0x40000000;
     }
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
-        if (version != 0) return ; // TODO: error.
-        created = read32(is);
-        modified = read32(is);
-        timeScale = read32(is);
-        duration = read32(is);
-        rate = read32(is);
-        volume = read32(is);
-        read32(is);
-        read32(is);
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        if (version == 1) {
+            created = r.u64();
+            modified = r.u64();
+            timeScale = r.u32();
+            duration = r.u64();
+        } else {
+            created = r.u32();
+            modified = r.u32();
+            timeScale = r.u32();
+            duration = r.u32();
+        }
+        rate = r.u32();
+        volume = r.u32();
+        r.skip(8);
         for (auto &d : matrix) {
-            d = read32(is);
+            d = r.u32();
         }
-        for (int i=0; i<6; i++) {read32(is);}
-        next_track_id = read32(is);
+        r.skip(24);
+        next_track_id = r.u32();
     }
-    virtual void write(std::ostream &os) const {
-        FullBox::write(os);
-        write32(os, created);
-        write32(os, modified);
-        write32(os, timeScale);
-        write32(os, duration);
-        write32(os, rate);
-        write32(os, volume);
-        write32(os, 0);
-        write32(os, 0);
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        if (version == 1) {
+            w.u64(created);
+            w.u64(modified);
+            w.u32(timeScale);
+            w.u64(duration);
+        } else {
+            w.u32(created);
+            w.u32(modified);
+            w.u32(timeScale);
+            w.u32(duration);
+        }
+        w.u32(rate);
+        w.u32(volume);
+        w.zero(8);
         for (auto &d : matrix) {
-            write32(os, d);
+            w.u32(d);
         }
-        for (int i=0; i<6; i++) {write32(os, 0);}
-        write32(os, next_track_id);
+        w.zero(24);
+        w.u32(next_track_id);
+    }
+
+    virtual size_t calcSize() {
+        size = HEADER_SIZE + 20 * 4 + (version == 1 ? 28 : 16);
+        return size;
     }
 
     void dump_attr(std::ostream &os, const std::string &prefix) const {
@@ -451,37 +1210,37 @@ public:
         calcSize();
     }
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
         if (version == 1) {
-            created = read64(is);
-            modified = read64(is);
-            time_scale = read32(is);
-            duration = read64(is);
+            created = r.u64();
+            modified = r.u64();
+            time_scale = r.u32();
+            duration = r.u64();
         } else {
-            created = read32(is);
-            modified = read32(is);
-            time_scale = read32(is);
-            duration = read32(is);
+            created = r.u32();
+            modified = r.u32();
+            time_scale = r.u32();
+            duration = r.u32();
         }
-        lang = read16(is); // 1b + 5b * 3
-        read16(is); // 0
+        lang = r.u16(); // 1b + 5b * 3
+        r.skip(2); // 0
     }
-    virtual void write(std::ostream &os) const {
-        FullBox::write(os);
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
         if (version == 1) {
-            write64(os, created);
-            write64(os, modified);
-            write32(os, time_scale);
-            write64(os, duration);
+            w.u64(created);
+            w.u64(modified);
+            w.u32(time_scale);
+            w.u64(duration);
         } else {
-            write32(os, created);
-            write32(os, modified);
-            write32(os, time_scale);
-            write32(os, duration);
+            w.u32(created);
+            w.u32(modified);
+            w.u32(time_scale);
+            w.u32(duration);
         }
-        write16(os, lang);
-        write16(os, 0);
+        w.u16(lang);
+        w.u16(0);
     }
 
     virtual size_t calcSize() {
@@ -526,57 +1285,57 @@ public:
         height = 1;
     }
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
         if (version == 1) {
-            created = read64(is);
-            modified = read64(is);
-            track_id = read32(is);
-            read32(is); // 0
-            duration = read64(is);
+            created = r.u64();
+            modified = r.u64();
+            track_id = r.u32();
+            r.skip(4); // 0
+            duration = r.u64();
         } else {
-            created = read32(is);
-            modified = read32(is);
-            track_id = read32(is);
-            read32(is); // 0
-            duration = read32(is);
-        }
-        read64(is); // 0
-        layer = read16(is);
-        read16(is); //0
-        volume = read16(is);
-        read16(is); //0
+            created = r.u32();
+            modified = r.u32();
+            track_id = r.u32();
+            r.skip(4); // 0
+            duration = r.u32();
+        }
+        r.skip(8); // 0
+        layer = r.u16();
+        r.skip(2); //0
+        volume = r.u16();
+        r.skip(2); //0
         for (auto &d : matrix) {
-            d = read32(is);
+            d = r.u32();
         }
-        width = read32(is);
-        height = read32(is);
+        width = r.u32();
+        height = r.u32();
     }
-    virtual void write(std::ostream &os) const {
-        FullBox::write(os);
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
         if (version == 1) {
-            write64(os, created);
-            write64(os, modified);
-            write32(os, track_id);
-            write32(os, 0);
-            write64(os, duration);
+            w.u64(created);
+            w.u64(modified);
+            w.u32(track_id);
+            w.u32(0);
+            w.u64(duration);
         } else {
-            write32(os, created);
-            write32(os, modified);
-            write32(os, track_id);
-            write32(os, 0);
-            write32(os, duration);
-        }
-        write64(os, 0);
-        write16(os, layer);
-        write16(os, 0);
-        write16(os, volume);
-        write16(os, 0);
+            w.u32(created);
+            w.u32(modified);
+            w.u32(track_id);
+            w.u32(0);
+            w.u32(duration);
+        }
+        w.u64(0);
+        w.u16(layer);
+        w.u16(0);
+        w.u16(volume);
+        w.u16(0);
         for (auto &d : matrix) {
-            write32(os, d);
+            w.u32(d);
         }
-        write32(os, width);
-        write32(os, height);
+        w.u32(width);
+        w.u32(height);
     }
 
     virtual size_t calcSize() {
@@ -625,23 +1384,23 @@ public:
         return type_name;
     }
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
-        is.read(qt_type1, 4);
-        is.read(media_type, 4);
-        is.read(qt_type2, 12);
-        type_name.resize(size - HEADER_SIZE - 20 - 1);
-        is.read(&type_name[0], type_name.size());
-        read8(is);
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        r.read(qt_type1, 4);
+        r.read(media_type, 4);
+        r.read(qt_type2, 12);
+        type_name.resize(r.remaining() > 0 ? r.remaining() - 1 : 0);
+        r.read(&type_name[0], type_name.size());
+        r.skip(1);
     }
 
-    void write(std::ostream &os) const {
-        FullBox::write(os);
-        os.write(qt_type1, 4);
-        os.write(media_type, 4);
-        os.write(qt_type2, 12);
-        os.write(type_name.c_str(), type_name.size());
-        write8(os, 0);
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        w.bytes(qt_type1, 4);
+        w.bytes(media_type, 4);
+        w.bytes(qt_type2, 12);
+        w.bytes(type_name.c_str(), type_name.size());
+        w.u8(0);
     }
 
     size_t calcSize() {size = HEADER_SIZE + 20 + type_name.size() + 1; return size;}
@@ -665,6 +1424,107 @@ public:
         return std::string((char*)&buf[12],ui32(4) - 8);
     }
 
+    // first sample entry.
+    bool isAudio() const {
+        if (buf.size() < 12) return false;
+        switch (type()) {
+        case "mp4a"_4cc:
+        case "enca"_4cc:
+        case "ac-3"_4cc:
+        case "ec-3"_4cc:
+        case "Opus"_4cc:
+        case "fLaC"_4cc:
+            return true;
+        }
+        return false;
+    }
+    uint16_t width() const {return !isAudio() && buf.size() >= 4 + 36 ? ui16(4 + 32) : 0;}
+    uint16_t height() const {return !isAudio() && buf.size() >= 4 + 36 ? ui16(4 + 34) : 0;}
+    uint16_t channels() const {return isAudio() && buf.size() >= 4 + 36 ? ui16(4 + 24) : 0;}
+    uint32_t sampleRate() const {return isAudio() && buf.size() >= 4 + 36 ? ui32(4 + 32) >> 16 : 0;}
+
+    // child box of the first sample entry (avcC, hvcC, esds). payload, nullptr if not found.
+    const uint8_t *config(uint32_t boxtype, size_t &n) const {
+        if (buf.size() < 12) return nullptr;
+        size_t end = std::min<size_t>(buf.size(), 4 + (size_t)ui32(4));
+        for (size_t pos = 4 + 8 + (isAudio() ? 28 : 78); pos + 8 <= end;) {
+            size_t sz = ui32(pos);
+            if (sz < 8 || pos + sz > end) break;
+            if (ui32(pos + 4) == boxtype) {
+                n = sz - 8;
+                return &buf[pos + 8];
+            }
+            pos += sz;
+        }
+        return nullptr;
+    }
+
+    // RFC 6381 codecs parameter. avc1.4d401f, hvc1.1.6.L93.90, mp4a.40.2...
+    std::string codecString() const {
+        if (buf.size() < 12) return "";
+        std::string t = typeAsString();
+        const uint8_t *c;
+        size_t n = 0;
+        char s[64];
+        if ((c = config(fourcc("avcC"), n)) != nullptr && n >= 4) {
+            snprintf(s, sizeof(s), "%s.%02x%02x%02x", t.c_str(), c[1], c[2], c[3]);
+            return s;
+        }
+        if ((c = config(fourcc("hvcC"), n)) != nullptr && n >= 13) {
+            static const char *space[] = {"", "A", "B", "C"};
+            uint32_t compat = be32(c + 2), rev = 0;
+            for (int i = 0; i < 32; i++) rev |= ((compat >> i) & 1) << (31 - i);
+            std::string r = t + "." + space[c[1] >> 6] + std::to_string(c[1] & 0x1f);
+            snprintf(s, sizeof(s), ".%x.%c%d", rev, (c[1] & 0x20) ? 'H' : 'L', c[12]);
+            r += s;
+            int last = 11;
+            while (last >= 6 && c[last] == 0) last--; // trailing zero constraint bytes are omitted.
+            for (int i = 6; i <= last; i++) {
+                snprintf(s, sizeof(s), ".%02x", c[i]);
+                r += s;
+            }
+            return r;
+        }
+        if ((c = config(fourcc("esds"), n)) != nullptr && n >= 4) {
+            // ES_Descriptor(3) > DecoderConfigDescriptor(4) > DecoderSpecificInfo(5)
+            int oti = -1, aot = -1;
+            for (size_t p = 4; p + 2 <= n;) {
+                uint8_t tag = c[p++];
+                size_t len = 0;
+                for (int i = 0; i < 4 && p < n; i++) {
+                    uint8_t b = c[p++];
+                    len = (len << 7) | (b & 0x7f);
+                    if (!(b & 0x80)) break;
+                }
+                if (tag == 3) {
+                    if (p + 3 > n) break;
+                    uint8_t f = c[p + 2];
+                    p += 3;
+                    if (f & 0x80) p += 2; // dependsOn_ES_ID
+                    if (f & 0x40) p += (p < n ? c[p] : 0) + 1; // URL
+                    if (f & 0x20) p += 2; // OCR_ES_Id
+                } else if (tag == 4) {
+                    if (p + 13 > n) break;
+                    oti = c[p];
+                    p += 13;
+                } else if (tag == 5) {
+                    if (p < n) {
+                        aot = c[p] >> 3;
+                        if (aot == 31 && p + 1 < n) aot = 32 + (((c[p] & 7) << 3) | (c[p + 1] >> 5));
+                    }
+                    break;
+                } else {
+                    p += len;
+                }
+            }
+            if (oti >= 0) {
+                snprintf(s, sizeof(s), aot > 0 ? "%s.%02x.%d" : "%s.%02x", t.c_str(), oti, aot);
+                return s;
+            }
+        }
+        return t;
+    }
+
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
         uint32_t c = count();
         os << prefix << " count: " << c << std::endl;
@@ -687,6 +1547,8 @@ public:
     uint32_t first(int n) const {return ui32(4 + n * 12);}
     uint32_t spc(int n) const {return ui32(4 + n * 12 + 4);}
     void clear(){buf.resize(4); ui32(0,0);}
+    // first_chunk, samples_per_chunk, desc_index for each entry.
+    TableReader entries() const {return table(4, count(), 3);}
 
     uint32_t sampleToChunk(int n) const {
         // n: [0..(numSample-1)]
@@ -728,6 +1590,8 @@ public:
     uint32_t count(uint32_t n) const {return ui32(4 + n*8);}
     uint32_t delta(uint32_t n) const {return ui32(4 + n*8 + 4);}
     void clear(){buf.resize(4); ui32(0,0);}
+    // count, delta for each entry.
+    TableReader entries() const {return table(4, count(), 2);}
 
     uint64_t sampleToTime(uint32_t n) const {
         uint32_t c = count();
@@ -763,6 +1627,8 @@ public:
 
     uint32_t count(uint32_t n) const {return ui32(4 + 8*n);}
     uint32_t offset(uint32_t n) const {return ui32(4 + 8*n + 4);}
+    // count, offset for each entry.
+    TableReader entries() const {return table(4, count(), 2);}
     uint32_t sampleToOffset(int n) const {
         // n: [0..(numSample-1)]
         uint32_t c = count();
@@ -788,22 +1654,49 @@ public:
     }
 };
 
+// chunk offsets. stco (32bit) or co64 (64bit) by type.
+// a stco is turned into a co64 when an offset does not fit 32bit.
 class BoxSTCO : public FullBufBox{
 public:
-    BoxSTCO(size_t sz) : FullBufBox(BOX_STCO, sz) {}
+    BoxSTCO(size_t sz, uint32_t boxtype = BOX_STCO) : FullBufBox(boxtype, sz) {}
     BoxSTCO() : FullBufBox(BOX_STCO, 16) {clear();}
 
+    bool is64() const {return type == BOX_CO64;}
     uint32_t count() const {return ui32(0);}
-    uint32_t offset(int pos) const {return ui32(4+pos*4);}
+    uint64_t offset(int pos) const {return is64() ? ui64(4+pos*8) : ui32(4+pos*4);}
+    void setOffset(int pos, uint64_t v) {
+        if (!is64() && v > UINT32_MAX) promote();
+        if (is64()) ui64(4+pos*8, v); else ui32(4+pos*4, v);
+    }
+    void add(uint64_t v) {
+        uint32_t c = count();
+        buf.resize(4 + (c + 1) * (is64() ? 8 : 4));
+        ui32(0, c + 1);
+        setOffset(c, v);
+    }
     void clear(){buf.resize(4); ui32(0,0);}
 
-    void moveAll(int ofs) {
-        uint32_t c = count();
-        for (int i=0; i<c;i++) {
-            ui32(4+i*4, offset(i) + ofs);
+    void moveAll(int64_t ofs) {
+        uint32_t c = ui32s(4, count(), is64() ? 2 : 1);
+        for (uint32_t i=0; i<c;i++) {
+            setOffset(i, offset(i) + ofs);
         }
     }
 
+    // stco -> co64
+    void promote() {
+        if (is64()) return;
+        uint32_t c = ui32s(4, count());
+        std::vector<uint8_t> b(4 + (size_t)c * 8);
+        put_be32(&b[0], c);
+        for (uint32_t i=0; i<c; i++) {
+            put_be64(&b[4 + i*8], ui32(4+i*4));
+        }
+        buf.assign(b.data(), b.size());
+        type = BOX_CO64;
+        calcSize();
+    }
+
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
         uint32_t c = count();
         os << prefix << " count: " << c << std::endl;
@@ -819,12 +1712,19 @@ public:
 
     uint32_t count() const {return ui32(0);}
     uint32_t sync(int pos) const {return ui32(4+pos*4);}
+    TableReader syncs() const {return table(4, count());}
     bool include(uint32_t sample) const {
-        uint32_t c = count();
-        for (int i=0; i<c; i++) {
-            if (sync(i) == sample) return true; // TODO binary search.
+        uint32_t i = lowerBound(sample);
+        return i < count() && sync(i) == sample;
+    }
+    // first entry >= sample. count() if none.
+    uint32_t lowerBound(uint32_t sample) const {
+        uint32_t lo = 0, hi = count();
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (sync(mid) < sample) lo = mid + 1; else hi = mid;
         }
-        return false;
+        return lo;
     }
 
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
@@ -844,6 +1744,14 @@ public:
     uint32_t constantSize() const {return ui32(0);}
     uint32_t count() const {return ui32(4);}
     uint32_t size(int pos) const {return ui32(8+pos*4);}
+    void sizes(std::vector<uint32_t> &out) const {
+        if (constantSize()) {
+            out.assign(count(), constantSize());
+        } else {
+            out.resize(ui32s(8, count()));
+            be32_decode(out.data(), buf.data() + 8, out.size());
+        }
+    }
     void clear(){buf.resize(8); ui32(0,0); ui32(4,0);}
 
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
@@ -867,27 +1775,23 @@ public:
     uint32_t minor;
     std::vector<uint32_t> compat;
 
-    void parse(std::istream &is) {
-        is.read(major, 4);
-        minor = read32(is);
-        for (int i=0; i<(size-16)/4; i++) {
-            uint32_t b;
-            is.read((char*)&b, 4);
-            compat.push_back(b);
-        }
+    void decode(ByteReader &r) {
+        r.read(major, 4);
+        minor = r.u32();
+        compat.resize(r.remaining() / 4);
+        r.read(compat.data(), compat.size() * 4);
     }
 
-    virtual void write(std::ostream &os) const {
-        Box::write(os);
-        os.write(major, 4);
-        write32(os, minor);
-        os.write((char*)&compat[0], compat.size()*4);
+    void encode(ByteWriter &w) const {
+        w.bytes(major, 4);
+        w.u32(minor);
+        w.bytes(compat.data(), compat.size()*4);
     }
 
     virtual size_t calcSize() {size = compat.size()*4 +16; return size;}
 
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
-        os << prefix << " major: " << major << std::endl;
+        os << prefix << " major: " << std::string(major, 4) << std::endl;
         os << prefix << " minor: " << minor << std::endl;
     }
 };
@@ -907,22 +1811,22 @@ public:
         sample_flags = 0;
     }
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
-        track_id = read32(is);
-        sample_desc = read32(is);
-        sample_duration = read32(is);
-        sample_size = read32(is);
-        sample_flags = read32(is);
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        track_id = r.u32();
+        sample_desc = r.u32();
+        sample_duration = r.u32();
+        sample_size = r.u32();
+        sample_flags = r.u32();
     }
 
-    void write(std::ostream &os) const {
-        FullBox::write(os);
-        write32(os, track_id);
-        write32(os, sample_desc);
-        write32(os, sample_duration);
-        write32(os, sample_size);
-        write32(os, sample_flags);
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        w.u32(track_id);
+        w.u32(sample_desc);
+        w.u32(sample_duration);
+        w.u32(sample_size);
+        w.u32(sample_flags);
     }
 
     size_t calcSize() {size = 32; return size;}
@@ -943,10 +1847,10 @@ public:
     uint32_t time_scale;
     uint64_t pts;
     uint64_t first_offset; // offset to moof
-    std::vector<uint32_t> data;
+    std::pmr::vector<uint32_t> data;
 
-    BoxSIDX(size_t sz) : FullBox(BOX_SIDX, sz) {}
-    BoxSIDX() : FullBox(BOX_SIDX, HEADER_SIZE+28), track_id(1), time_scale(1000),first_offset(0) {version = 1;}
+    BoxSIDX(size_t sz) : FullBox(BOX_SIDX, sz), data(box_memory_resource()) {}
+    BoxSIDX() : FullBox(BOX_SIDX, HEADER_SIZE+28), track_id(1), time_scale(1000),first_offset(0), data(box_memory_resource()) {version = 1;}
 
     int count() const {return data.size()/3;}
     uint32_t duration(int n) const {return data[n*3+1];}
@@ -957,33 +1861,42 @@ public:
         data.push_back(flag);
     }
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
-        track_id = read32(is);
-        time_scale = read32(is);
-        pts = read64(is);
-        first_offset = read64(is);
-        int count = read32(is);
-        for (int i=0; i<count; i++) {
-            data.push_back(read32(is));
-            data.push_back(read32(is));
-            data.push_back(read32(is));
-        }
-    }
-
-    void write(std::ostream &os) const {
-        FullBox::write(os);
-        write32(os, track_id);
-        write32(os, time_scale);
-        write64(os, pts);
-        write64(os, first_offset);
-        write32(os, count());
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        track_id = r.u32();
+        time_scale = r.u32();
+        if (version == 1) {
+            pts = r.u64();
+            first_offset = r.u64();
+        } else {
+            pts = r.u32();
+            first_offset = r.u32();
+        }
+        int count = r.u32() & 0xffff; // reserved(16) + reference_count(16)
+        data.resize(count * 3);
+        for (auto &d : data) {
+            d = r.u32();
+        }
+    }
+
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        w.u32(track_id);
+        w.u32(time_scale);
+        if (version == 1) {
+            w.u64(pts);
+            w.u64(first_offset);
+        } else {
+            w.u32(pts);
+            w.u32(first_offset);
+        }
+        w.u32(count());
         for (int i=0; i<data.size(); i++) {
-            write32(os, data[i]);
+            w.u32(data[i]);
         }
     }
 
-    size_t calcSize() {size = HEADER_SIZE+28 + data.size()*sizeof(uint32_t); return size;}
+    size_t calcSize() {size = HEADER_SIZE + (version == 1 ? 28 : 20) + data.size()*sizeof(uint32_t); return size;}
 
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
         FullBox::dump_attr(os, prefix);
@@ -1004,14 +1917,14 @@ public:
 
     BoxMFHD(size_t sz = 0) : FullBox(BOX_MFHD, sz), fragments(1) {}
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
-        fragments = read32(is);
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        fragments = r.u32();
     }
 
-    void write(std::ostream &os) const {
-        FullBox::write(os);
-        write32(os, fragments);
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        w.u32(fragments);
     }
 
     size_t calcSize() {size = HEADER_SIZE + 4; return size;}
@@ -1029,18 +1942,18 @@ public:
 
     BoxTFDT(size_t sz = 0) : FullBox(BOX_TFDT, sz), flag_start(0) {}
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
         if (version == 1) {
-            flag_start = read64(is);
+            flag_start = r.u64();
         } else {
-            flag_start = read32(is);
+            flag_start = r.u32();
         }
     }
 
-    void write(std::ostream &os) const {
-        FullBox::write(os);
-        write64(os, flag_start);
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        w.u64(flag_start);
     }
 
     size_t calcSize() {
@@ -1064,49 +1977,77 @@ public:
     static const int FLAG_SAMPLE_FLAGS = 0x0400;
     static const int FLAG_SAMPLE_CTS = 0x0800;
 
-    uint64_t data_offset; // := sizeof moof.
-    std::vector<uint32_t> data;
+    uint32_t sample_count; // set directly if there are no per sample fields (all from tfhd/trex).
+    int32_t data_offset; // from the base data offset (moof). := sizeof moof + mdat header.
+    uint32_t first_sample_flags;
+    std::pmr::vector<uint32_t> data; // fields() values per sample. duration, size, flags, cts.
 
-    BoxTRUN(size_t sz) : FullBox(BOX_TRUN, sz) {}
-    BoxTRUN() : FullBox(BOX_TRUN, HEADER_SIZE+28) {}
+    BoxTRUN(size_t sz) : FullBox(BOX_TRUN, sz), sample_count(0), data_offset(0), first_sample_flags(0), data(box_memory_resource()) {}
+    BoxTRUN() : FullBox(BOX_TRUN, HEADER_SIZE+28), sample_count(0), data_offset(0), first_sample_flags(0), data(box_memory_resource()) {}
 
-    int count() const {return data.size()/fields();}
-    uint32_t duration(int n) const {return data[n*3+1];}
-    bool startsWithSAP(int n) const {return (data[n*3+2]&0x80000000) != 0;}
+    int count() const {return sample_count;}
+    // a per sample field value, in flag order (set flags first). sample_count follows the complete samples.
     void add(uint32_t v) {
         data.push_back(v);
+        if (fields()) sample_count = data.size() / fields();
     }
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
-        int n = read32(is) * fields();
-        for (int i=0; i<n; i++) {
-            data.push_back(read32(is));
+    // per sample fields. def if the field is not present.
+    uint32_t sampleDuration(int n, uint32_t def) const {return field(n, FLAG_SAMPLE_DURATION, def);}
+    uint32_t sampleSize(int n, uint32_t def) const {return field(n, FLAG_SAMPLE_SIZE, def);}
+    uint32_t sampleFlags(int n, uint32_t def) const {
+        if (n == 0 && (flags & FLAG_FIRST_SAMPLE_FLAGS)) return first_sample_flags;
+        return field(n, FLAG_SAMPLE_FLAGS, def);
+    }
+    int32_t sampleCtsOffset(int n) const {return field(n, FLAG_SAMPLE_CTS, 0);} // signed in version 1.
+
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        uint32_t n = r.u32();
+        if (flags & FLAG_DATA_OFFSET) {
+            data_offset = r.u32();
+        }
+        if (flags & FLAG_FIRST_SAMPLE_FLAGS) {
+            first_sample_flags = r.u32();
+        }
+        sample_count = n;
+        if (fields()) {
+            sample_count = std::min<uint64_t>(n, r.remaining() / 4 / fields()); // truncated box
+        }
+        data.resize((size_t)sample_count * fields());
+        for (auto &d : data) {
+            d = r.u32();
         }
     }
 
-    void write(std::ostream &os) const {
-        FullBox::write(os);
-        write32(os, count());
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        w.u32(sample_count);
 
         if (flags & FLAG_DATA_OFFSET) {
-            write32(os, data_offset);
+            w.u32(data_offset);
         }
 
         if (flags & FLAG_FIRST_SAMPLE_FLAGS) {
-            write32(os, 0);
+            w.u32(first_sample_flags);
         }
 
         for (int i=0; i<data.size(); i++) {
-            write32(os, data[i]);
+            w.u32(data[i]);
         }
     }
 
-    size_t calcSize() {size = HEADER_SIZE+8 + data.size()*sizeof(uint32_t); return size;}
+    size_t calcSize() {
+        size = HEADER_SIZE + 4 + data.size()*sizeof(uint32_t);
+        if (flags & FLAG_DATA_OFFSET) size += 4;
+        if (flags & FLAG_FIRST_SAMPLE_FLAGS) size += 4;
+        return size;
+    }
 
     virtual void dump_attr(std::ostream &os, const std::string &prefix) const {
         FullBox::dump_attr(os, prefix);
         os << prefix << " count: " << count() << std::endl;
+        if (flags & FLAG_DATA_OFFSET) os << prefix << " data_offset: " << data_offset << std::endl;
     }
 
 private:
@@ -1118,6 +2059,15 @@ private:
         if (flags & FLAG_SAMPLE_CTS) f++;
         return f;
     }
+    // fields are in flag order.
+    uint32_t field(int n, int flag, uint32_t def) const {
+        if (!(flags & flag) || n < 0 || (uint32_t)n >= sample_count) return def;
+        int f = 0;
+        for (int b = FLAG_SAMPLE_DURATION; b < flag; b <<= 1) {
+            if (flags & b) f++;
+        }
+        return data[n * fields() + f];
+    }
 };
 
 class BoxTFHD : public FullBox{
@@ -1131,33 +2081,54 @@ public:
     static const int FLAG_DEFAULT_BASE_IS_MOOF = 0x020000;
 
     uint32_t track_id;
+    uint64_t base_data_offset;
+    uint32_t sample_desc;
     uint32_t default_duration;
     uint32_t default_size;
     uint32_t default_flags;
 
-    BoxTFHD(size_t sz = 0) : FullBox(BOX_TFHD, sz), track_id(1) {
+    BoxTFHD(size_t sz = 0) : FullBox(BOX_TFHD, sz), track_id(1), base_data_offset(0), sample_desc(1),
+        default_duration(0), default_size(0), default_flags(0) {
         flags = FLAG_DEFAULT_BASE_IS_MOOF | FLAG_DEFAULT_DURATION;
     }
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
-        track_id = read32(is);
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        track_id = r.u32();
+        if (flags & FLAG_BASE_DATA_OFFSET) {
+            base_data_offset = r.u64();
+        }
+        if (flags & FLAG_STSD_ID) {
+            sample_desc = r.u32();
+        }
+        if (flags & FLAG_DEFAULT_DURATION) {
+            default_duration = r.u32();
+        }
+        if (flags & FLAG_DEFAULT_SIZE) {
+            default_size = r.u32();
+        }
+        if (flags & FLAG_DEFAULT_FLAGS) {
+            default_flags = r.u32();
+        }
     }
 
-    void write(std::ostream &os) const {
-        FullBox::write(os);
-        write32(os, track_id);
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        w.u32(track_id);
         if (flags & FLAG_BASE_DATA_OFFSET) {
-            write64(os, 0);
+            w.u64(base_data_offset);
+        }
+        if (flags & FLAG_STSD_ID) {
+            w.u32(sample_desc);
         }
         if (flags & FLAG_DEFAULT_DURATION) {
-            write32(os, default_duration);
+            w.u32(default_duration);
         }
         if (flags & FLAG_DEFAULT_SIZE) {
-            write32(os, default_size);
+            w.u32(default_size);
         }
         if (flags & FLAG_DEFAULT_FLAGS) {
-            write32(os, default_flags);
+            w.u32(default_flags);
         }
     }
 
@@ -1166,6 +2137,9 @@ public:
         if (flags & FLAG_BASE_DATA_OFFSET) {
             size += 8;
         }
+        if (flags & FLAG_STSD_ID) {
+            size += 4;
+        }
         if (flags & FLAG_DEFAULT_DURATION) {
             size += 4;
         }
@@ -1181,6 +2155,140 @@ public:
     void dump_attr(std::ostream &os, const std::string &prefix) const {
         FullBox::dump_attr(os, prefix);
         os << prefix << " track_id: " << track_id << std::endl;
+        if (flags & FLAG_BASE_DATA_OFFSET) os << prefix << " base_data_offset: " << base_data_offset << std::endl;
+        if (flags & FLAG_DEFAULT_DURATION) os << prefix << " default_duration: " << default_duration << std::endl;
+        if (flags & FLAG_DEFAULT_SIZE) os << prefix << " default_size: " << default_size << std::endl;
+        if (flags & FLAG_DEFAULT_FLAGS) os << prefix << " default_flags: " << default_flags << std::endl;
+    }
+};
+
+// track fragment random access. sync sample presentation times -> moof offsets, sorted by time.
+class BoxTFRA : public FullBox{
+public:
+    struct Entry {
+        uint64_t time;
+        uint64_t moof_offset;
+        uint32_t traf_number; // 1 based
+        uint32_t trun_number;
+        uint32_t sample_number;
+    };
+    uint32_t track_id;
+    std::pmr::vector<Entry> entries;
+
+    BoxTFRA(size_t sz = 0) : FullBox(BOX_TFRA, sz), track_id(1), entries(box_memory_resource()) {}
+
+    int count() const {return entries.size();}
+    void add(uint64_t time, uint64_t moof_offset, uint32_t traf = 1, uint32_t trun = 1, uint32_t sample = 1) {
+        if (time > UINT32_MAX || moof_offset > UINT32_MAX) version = 1;
+        entries.push_back({time, moof_offset, traf, trun, sample});
+    }
+
+    // last entry with time <= t. -1 if t is before the first entry. O(log n)
+    int find(uint64_t t) const {
+        auto it = std::upper_bound(entries.begin(), entries.end(), t,
+                                   [](uint64_t t, const Entry &e) {return t < e.time;});
+        return (int)(it - entries.begin()) - 1;
+    }
+
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        track_id = r.u32();
+        uint32_t lengths = r.u32(); // reserved(26) + length_size_of_traf_num(2) + trun_num(2) + sample_num(2)
+        int traf_len = (lengths >> 4 & 3) + 1, trun_len = (lengths >> 2 & 3) + 1, sample_len = (lengths & 3) + 1;
+        uint32_t n = r.u32();
+        size_t entry_size = (version == 1 ? 16 : 8) + traf_len + trun_len + sample_len;
+        n = std::min<uint64_t>(n, r.remaining() / entry_size);
+        entries.resize(n);
+        for (auto &e : entries) {
+            e.time = version == 1 ? r.u64() : r.u32();
+            e.moof_offset = version == 1 ? r.u64() : r.u32();
+            e.traf_number = number(r, traf_len);
+            e.trun_number = number(r, trun_len);
+            e.sample_number = number(r, sample_len);
+        }
+    }
+
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        int traf_len, trun_len, sample_len;
+        lengths(traf_len, trun_len, sample_len);
+        w.u32(track_id);
+        w.u32((traf_len - 1) << 4 | (trun_len - 1) << 2 | (sample_len - 1));
+        w.u32(entries.size());
+        for (auto &e : entries) {
+            if (version == 1) {
+                w.u64(e.time);
+                w.u64(e.moof_offset);
+            } else {
+                w.u32(e.time);
+                w.u32(e.moof_offset);
+            }
+            number(w, e.traf_number, traf_len);
+            number(w, e.trun_number, trun_len);
+            number(w, e.sample_number, sample_len);
+        }
+    }
+
+    size_t calcSize() {
+        int traf_len, trun_len, sample_len;
+        lengths(traf_len, trun_len, sample_len);
+        size = HEADER_SIZE + 12 + entries.size() * ((version == 1 ? 16 : 8) + traf_len + trun_len + sample_len);
+        return size;
+    }
+
+    void dump_attr(std::ostream &os, const std::string &prefix) const {
+        FullBox::dump_attr(os, prefix);
+        os << prefix << " track_id: " << track_id << std::endl;
+        os << prefix << " count: " << count() << std::endl;
+        for (auto &e : entries) {
+            os << prefix << "  time: " << e.time << " moof_offset: " << e.moof_offset << " traf:" << e.traf_number
+               << " trun:" << e.trun_number << " sample:" << e.sample_number << std::endl;
+        }
+    }
+
+private:
+    static uint32_t number(ByteReader &r, int len) {
+        uint32_t v = 0;
+        for (int i = 0; i < len; i++) v = v << 8 | r.u8();
+        return v;
+    }
+    static void number(ByteWriter &w, uint32_t v, int len) {
+        for (int i = len - 1; i >= 0; i--) w.u8(v >> (i * 8));
+    }
+    static int bytes(uint32_t v) {return v > 0xffffff ? 4 : v > 0xffff ? 3 : v > 0xff ? 2 : 1;}
+    // smallest field sizes that hold every entry.
+    void lengths(int &traf_len, int &trun_len, int &sample_len) const {
+        traf_len = trun_len = sample_len = 1;
+        for (auto &e : entries) {
+            traf_len = std::max(traf_len, bytes(e.traf_number));
+            trun_len = std::max(trun_len, bytes(e.trun_number));
+            sample_len = std::max(sample_len, bytes(e.sample_number));
+        }
+    }
+};
+
+// last box of mfra. the size of mfra, so that it can be found from the end of the file.
+class BoxMFRO : public FullBox{
+public:
+    uint32_t mfra_size;
+
+    BoxMFRO(size_t sz = 0) : FullBox(BOX_MFRO, sz), mfra_size(0) {}
+
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        mfra_size = r.u32();
+    }
+
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        w.u32(mfra_size);
+    }
+
+    size_t calcSize() {size = HEADER_SIZE + 4; return size;}
+
+    void dump_attr(std::ostream &os, const std::string &prefix) const {
+        FullBox::dump_attr(os, prefix);
+        os << prefix << " mfra_size: " << mfra_size << std::endl;
     }
 };
 
@@ -1192,31 +2300,36 @@ public:
 
     BoxPSSH(size_t sz = 0) : FullBox(BOX_PSSH, sz) {}
 
-    void parse(std::istream &is) {
-        FullBox::parse(is);
-        is.read((char*)system_id, 16);
-        int count = read32(is);
-        char keybuf[16];
-        for (int i=0;i<count; i++) {
-            is.read(keybuf, 16);
-            kids.push_back(std::string(keybuf, 16));
+    void decode(ByteReader &r) {
+        FullBox::decode(r);
+        r.read(system_id, 16);
+        if (version > 0) { // KIDs: version 1 only.
+            int count = r.u32();
+            char keybuf[16];
+            for (int i=0;i<count && !r.fail(); i++) {
+                r.read(keybuf, 16);
+                kids.push_back(std::string(keybuf, 16));
+            }
         }
-        data.resize(read32(is));
-        is.read((char*)&data[0], data.size());
+        size_t n = r.u32();
+        data.resize(std::min(n, r.remaining()));
+        r.read(data.data(), data.size());
     }
 
-    void write(std::ostream &os) const {
-        FullBox::write(os);
-        os.write((char*)system_id ,16);
-        write32(os, kids.size());
-        for (auto &kid : kids) {
-            os.write(kid.c_str(), 16);
+    void encode(ByteWriter &w) const {
+        FullBox::encode(w);
+        w.bytes(system_id ,16);
+        if (version > 0) {
+            w.u32(kids.size());
+            for (auto &kid : kids) {
+                w.bytes(kid.c_str(), 16);
+            }
         }
-        write32(os, data.size());
-        os.write((char*)&data[0], data.size());
+        w.u32(data.size());
+        w.bytes(data.data(), data.size());
     }
 
-    size_t calcSize() {size = HEADER_SIZE + 20 + kids.size()*16; return size;}
+    size_t calcSize() {size = HEADER_SIZE + 20 + (version > 0 ? 4 + kids.size()*16 : 0) + data.size(); return size;}
 
     void dump_attr(std::ostream &os, const std::string &prefix) const {
         FullBox::dump_attr(os, prefix);
@@ -1224,17 +2337,111 @@ public:
     }
 };
 
-class BoxSimpleList : public Box {
-    bool chktype(const char t1[4], const char t2[4]) {
-        return memcmp(t1, t2, 4)==0;
+// box type -> box class. applications can add their own box classes:
+//   BoxRegistry::instance().add<BoxPSSH>(BOX_PSSH);
+// register before parsing. not thread safe.
+class BoxRegistry {
+public:
+    typedef Box *(*Factory)(uint32_t type, size_t size);
+    struct Entry {
+        Factory create; // nullptr for containers.
+        bool container;
+    };
+
+    static BoxRegistry &instance() {
+        static BoxRegistry registry;
+        return registry;
     }
+
+    void add(uint32_t type, Factory f) {entries[type] = Entry{f, false};}
+    template<typename T>
+    void add(uint32_t type) {
+        add(type, [](uint32_t, size_t sz) -> Box* {return new T(sz);});
+    }
+    // box which has only child boxes. parsed as BoxSimpleList.
+    void addContainer(uint32_t type) {entries[type] = Entry{nullptr, true};}
+    void remove(uint32_t type) {entries.erase(type);}
+
+    const Entry *find(uint32_t type) const {
+        auto it = entries.find(type);
+        return it == entries.end() ? nullptr : &it->second;
+    }
+    bool container(uint32_t type) const {
+        const Entry *e = find(type);
+        return e != nullptr && e->container;
+    }
+
+private:
+    std::unordered_map<uint32_t, Entry> entries;
+
+    BoxRegistry() {
+        add<BoxFTYP>(BOX_FTYP);
+        add<BoxFREE>(BOX_FREE);
+        add<BoxMVHD>(BOX_MVHD);
+        add<BoxMDHD>(BOX_MDHD);
+        add<BoxTKHD>(BOX_TKHD);
+        add<BoxHDLR>(BOX_HDLR);
+        add<BoxSTSC>(BOX_STSC);
+        add<BoxSTSD>(BOX_STSD);
+        add<BoxSTSS>(BOX_STSS);
+        add<BoxSTSZ>(BOX_STSZ);
+        add<BoxSTCO>(BOX_STCO);
+        add(BOX_CO64, [](uint32_t t, size_t sz) -> Box* {return new BoxSTCO(sz, t);});
+        add<BoxSTTS>(BOX_STTS);
+        add<BoxCTTS>(BOX_CTTS);
+
+        add<BoxSTYP>(BOX_STYP);
+        add<BoxSIDX>(BOX_SIDX);
+        add<BoxTREX>(BOX_TREX);
+        add<BoxTFRA>(BOX_TFRA);
+        add<BoxMFRO>(BOX_MFRO);
+
+        for (auto t : HAS_CHILD_BOX) addContainer(t);
+    }
+};
+
+static inline bool has_child(uint32_t type) {
+    return BoxRegistry::instance().container(type);
+}
+
+struct ParseOptions {
+    // parse box headers only. payloads are decoded on first access
+    // (findByType, findAllByType, dump, write). the stream must stay open.
+    bool lazy;
+    // decode only these box types while parsing. others are lazy.
+    std::vector<uint32_t> types;
+
+    ParseOptions(bool lazy = false) : lazy(lazy) {}
+    ParseOptions(std::initializer_list<uint32_t> types) : lazy(true), types(types) {}
+    ParseOptions(std::initializer_list<const char*> names) : lazy(true) {
+        for (auto n : names) types.push_back(fourcc(n));
+    }
+
+    bool eager(uint32_t type) const {
+        if (types.empty()) return !lazy;
+        return std::find(types.begin(), types.end(), type) != types.end();
+    }
+};
+
+class BoxSimpleList : public Box {
 public:
-    BoxSimpleList(const char boxtype[4], size_t sz = 0) : Box(boxtype, sz) {}
+    const ParseOptions *options; // nullptr: decode all.
+
+    BoxSimpleList(uint32_t boxtype, size_t sz = 0, std::pmr::memory_resource *mr = box_memory_resource())
+        : Box(boxtype, sz, mr), options(nullptr) {}
+    BoxSimpleList(const char boxtype[4], size_t sz = 0, std::pmr::memory_resource *mr = box_memory_resource())
+        : Box(fourcc(boxtype), sz, mr), options(nullptr) {}
 
     void add(Box *b) {
         b->ref_count++;
         children.push_back(b);
     }
+    // takes the reference of a new box: it is deleted with this box. add() shares it (ref_count).
+    template<typename T>
+    T *adopt(T *b) {
+        children.push_back(b);
+        return b;
+    }
     void clear() {
         for (auto &b :children) {
             b->ref_count--;
@@ -1243,59 +2450,11 @@ public:
         children.clear();
     }
 
-    Box* createBox(const char boxtype[4], const size_t sz) {
-        if (chktype(boxtype, BOX_FTYP)) {
-            return new BoxFTYP(sz);
-        }
-        if (chktype(boxtype, BOX_FREE)) {
-            return new BoxFREE(sz);
-        }
-        if (chktype(boxtype, BOX_MVHD)) {
-            return new BoxMVHD(sz);
-        }
-        if (chktype(boxtype, BOX_MDHD)) {
-            return new BoxMDHD(sz);
-        }
-        if (chktype(boxtype, BOX_TKHD)) {
-            return new BoxTKHD(sz);
-        }
-        if (chktype(boxtype, BOX_HDLR)) {
-            return new BoxHDLR(sz);
-        }
-        if (chktype(boxtype, BOX_STSC)) {
-            return new BoxSTSC(sz);
-        }
-        if (chktype(boxtype, BOX_STSD)) {
-            return new BoxSTSD(sz);
-        }
-        if (chktype(boxtype, BOX_STSS)) {
-            return new BoxSTSS(sz);
-        }
-        if (chktype(boxtype, BOX_STSZ)) {
-            return new BoxSTSZ(sz);
-        }
-        if (chktype(boxtype, BOX_STCO)) {
-            return new BoxSTCO(sz);
-        }
-        if (chktype(boxtype, BOX_STTS)) {
-            return new BoxSTTS(sz);
-        }
-        if (chktype(boxtype, BOX_CTTS)) {
-            return new BoxCTTS(sz);
-        }
-
-        if (chktype(boxtype, BOX_STYP)) {
-            return new BoxSTYP(sz);
-        }
-        if (chktype(boxtype, BOX_SIDX)) {
-            return new BoxSIDX(sz);
-        }
-        if (chktype(boxtype, BOX_TREX)) {
-            return new BoxTREX(sz);
-        }
-
-        if (has_child(boxtype)) {
-            return new BoxSimpleList(boxtype, sz);
+    Box* createBox(uint32_t boxtype, const size_t sz) {
+        const BoxRegistry::Entry *e = BoxRegistry::instance().find(boxtype);
+        if (e != nullptr) {
+            if (e->container) return new BoxSimpleList(boxtype, sz);
+            return e->create(boxtype, sz);
         }
         if (sz > BOX_READ_SIZE_LIMIT) { // skip large box.
             return new UnknownBoxRef(boxtype, sz);
@@ -1304,16 +2463,33 @@ public:
     }
 
     void parse(std::istream &is) {
-        size_t pos = is.tellg();
-        size_t end = pos + size - 8;
-        char type[5] = {0};
+        uint64_t pos = is.tellg();
+        uint64_t end = pos + size - headerSize();
         while (pos < end) {
-            uint32_t sz = read32(is);
-            is.read(&type[0],4);
+            uint64_t sz = read32(is);
+            uint32_t type = read32(is);
             if (is.eof()) break;
+            uint32_t header = 8;
+            if (sz == 1) {
+                sz = read64(is);
+                header = 16;
+            } else if (sz == 0) {
+                sz = end - pos; // to the end of the parent (file).
+            }
+            if (sz < header || !is) break; // broken box.
 
             Box *b = createBox(type,sz);
-            b->parse(is);
+            b->largesize = header == 16;
+            b->body_offset = pos + header;
+            BoxSimpleList *list = dynamic_cast<BoxSimpleList*>(b);
+            if (list != nullptr) {
+                list->options = options;
+                b->parse(is);
+            } else if (options == nullptr || options->eager(type)) {
+                b->parse(is);
+            } else {
+                b->source = &is;
+            }
             children.push_back(b);
             pos += sz;
             is.seekg(pos,  std::ios_base::beg);
@@ -1321,26 +2497,919 @@ public:
     }
 
     virtual size_t calcSize() {
-        size = 8;
+        size_t payload = 0;
         for (auto &b : children) {
-            size += b->calcSize();
+            payload += b->load()->calcSize();
         }
+        size = sizeFor(payload);
         return size;
     }
 };
 
 
+// deep copy of a box (and its children) through write and parse.
+// e.g. to put a box of a tree read by other threads into a new tree,
+// since sharing updates ref_count and size of the box.
+static inline Box *copy_box(const Box *b) {
+    std::ostringstream os;
+    b->write(os);
+    const std::string s = os.str();
+    std::istringstream is(s);
+    BoxSimpleList list(BOX_FREE, s.size() + 8);
+    list.parse(is);
+    if (list.children.size() != 1) return nullptr;
+    Box *c = list.children[0];
+    c->ref_count++;
+    return c;
+}
+
+// box type -> boxes in document order. built once after parse, lookups don't walk the tree.
+// rebuild after adding or removing boxes.
+class BoxIndex {
+    struct Range {
+        uint32_t begin; // preorder number of the box.
+        uint32_t end;   // preorder number after its subtree.
+    };
+    struct TypeList {
+        std::vector<uint32_t> order;
+        std::vector<Box*> boxes;
+    };
+    std::unordered_map<const Box*, Range> ranges;
+    std::unordered_map<uint32_t, TypeList> types;
+    uint32_t counter;
+
+    void add(Box *b) {
+        Range r;
+        r.begin = counter++;
+        TypeList &l = types[b->type];
+        l.order.push_back(r.begin);
+        l.boxes.push_back(b);
+        for (auto c : b->children) add(c);
+        r.end = counter;
+        ranges[b] = r;
+    }
+public:
+    BoxIndex() : counter(0) {}
+
+    void build(Box *root) {
+        ranges.clear();
+        types.clear();
+        counter = 0;
+        add(root);
+    }
+
+    // all boxes of the type. document order. O(1)
+    const std::vector<Box*>& all(uint32_t type) const {
+        static const std::vector<Box*> empty;
+        auto it = types.find(type);
+        return it == types.end() ? empty : it->second.boxes;
+    }
+
+    // first box of the type in the subtree of scope (scope included). O(log n)
+    template<typename T = Box>
+    T* find(const Box *scope, uint32_t type) const {
+        auto r = ranges.find(scope);
+        auto it = types.find(type);
+        if (r == ranges.end() || it == types.end()) return nullptr;
+        const TypeList &l = it->second;
+        size_t i = std::lower_bound(l.order.begin(), l.order.end(), r->second.begin) - l.order.begin();
+        if (i == l.order.size() || l.order[i] >= r->second.end) return nullptr;
+        return dynamic_cast<T*>(l.boxes[i]->load());
+    }
+
+    // all boxes of the type in the subtree of scope.
+    template<typename T>
+    std::vector<T*>& findAll(std::vector<T*> &out, const Box *scope, uint32_t type) const {
+        auto r = ranges.find(scope);
+        auto it = types.find(type);
+        if (r == ranges.end() || it == types.end()) return out;
+        const TypeList &l = it->second;
+        size_t i = std::lower_bound(l.order.begin(), l.order.end(), r->second.begin) - l.order.begin();
+        for (; i < l.order.size() && l.order[i] < r->second.end; i++) {
+            T *b = dynamic_cast<T*>(l.boxes[i]->load());
+            if (b != nullptr) out.push_back(b);
+        }
+        return out;
+    }
+};
+
 class Mp4Root : public BoxSimpleList {
+    std::shared_ptr<MappedFile> mapped;
+    std::unique_ptr<MemoryStreamBuf> mapped_buf;
+    std::unique_ptr<std::istream> mapped_stream;
+    ParseOptions parse_options;
+    std::pmr::memory_resource *resource;
+    BoxIndex box_index;
 public:
-    Mp4Root() : BoxSimpleList("ROOT", 0x7fffffff) {} // TODO size
+    // mr: allocate the whole tree from mr (e.g. std::pmr::monotonic_buffer_resource)
+    // and release it in bulk. mr must outlive this and any tree sharing its boxes.
+    explicit Mp4Root(std::pmr::memory_resource *mr = box_memory_resource())
+        : BoxSimpleList("ROOT", 8, mr), resource(mr) {}
+
+    std::pmr::memory_resource *memoryResource() const {return resource;}
+
+    // parse boxes from the current position to the end of the stream.
+    void parse(std::istream &is) {
+        BoxAllocScope scope(resource);
+        std::streampos pos = is.tellg();
+        is.seekg(0, std::ios_base::end);
+        std::streampos end = is.tellg();
+        is.seekg(pos);
+        size = pos >= 0 && end >= pos ? (uint64_t)(end - pos) + 8 : SIZE_MAX / 2;
+        BoxSimpleList::parse(is);
+    }
+
+    void parse(std::istream &is, const ParseOptions &opt) {
+        parse_options = opt;
+        options = &parse_options;
+        parse(is);
+    }
+
+    // parse memory mapped file. payloads of FullBufBox, UnknownBox and BoxFREE
+    // refer to the mapping instead of copies. the mapping lives as long as this root.
+    void parse(const std::shared_ptr<MappedFile> &file, const ParseOptions &opt = ParseOptions()) {
+        mapped = file;
+        mapped_buf.reset(new MemoryStreamBuf(file->data(), file->size(), true, file->handle()));
+        mapped_stream.reset(new std::istream(mapped_buf.get()));
+        parse(*mapped_stream, opt);
+    }
+    bool parseMapped(const char *path, const ParseOptions &opt = ParseOptions()) {
+        auto file = std::make_shared<MappedFile>(path);
+        if (!file->is_open()) return false;
+        parse(file, opt);
+        return true;
+    }
+    const std::shared_ptr<MappedFile>& mappedFile() const {return mapped;}
+
+    // index for repeated lookups. call buildIndex() after parse or tree changes.
+    const BoxIndex& buildIndex() {
+        box_index.build(this);
+        return box_index;
+    }
+    const BoxIndex& index() const {return box_index;}
     virtual void write(std::ostream &os) const {
         for (int i=0; i<children.size(); i++) {
-            children[i]->calcSize();
+            children[i]->load()->calcSize();
             children[i]->write(os);
         }
     }
 };
 
+struct BoxHeader {
+    uint32_t type;
+    uint64_t size;     // 0: until end of stream.
+    uint64_t offset;   // stream position of the header.
+    uint32_t header_size;
+    int depth;         // 0: top level.
+    bool container;
+};
+
+// incremental parser for non-seekable input (pipe, socket, growing buffer).
+// feed() takes arbitrary chunks and reports boxes as events. only box headers
+// are buffered, payloads are passed through from the fed chunk.
+class BoxPushParser {
+public:
+    class Listener {
+    public:
+        virtual ~Listener() {}
+        // size 0 (to the end of stream) is resolved at boxEnd().
+        virtual void boxStart(const BoxHeader &) {}
+        // payload of a leaf box. may be called many times per box.
+        virtual void boxPayload(const BoxHeader &, const uint8_t *, size_t) {}
+        virtual void boxEnd(const BoxHeader &) {}
+    };
+
+    BoxPushParser(Listener *listener) : listener(listener), pos(0), hdr_len(0), in_payload(false), failed(false) {}
+
+    void feed(const uint8_t *data, size_t len) {
+        while (len > 0 && !failed) {
+            if (in_payload) {
+                size_t n = len;
+                if (leaf.size != 0 && n > remaining) n = remaining;
+                listener->boxPayload(leaf, data, n);
+                data += n;
+                len -= n;
+                pos += n;
+                if (leaf.size != 0) {
+                    remaining -= n;
+                    if (remaining == 0) endLeaf();
+                }
+                continue;
+            }
+
+            size_t need = hdr_len < 8 ? 8 : 16;
+            size_t n = std::min(need - hdr_len, len);
+            memcpy(hdr + hdr_len, data, n);
+            hdr_len += n;
+            data += n;
+            len -= n;
+            pos += n;
+            if (hdr_len == 8 && be32(hdr) == 1) continue; // 64bit largesize follows.
+            if (hdr_len == need) startBox();
+        }
+    }
+
+    // end of input. closes a box running to the end of stream.
+    void finish() {
+        if (in_payload && leaf.size == 0) endLeaf();
+        if (hdr_len > 0 || in_payload || !stack.empty()) failed = true; // truncated.
+    }
+
+    bool error() const {return failed;}
+    uint64_t position() const {return pos;}
+    int depth() const {return stack.size();}
+
+private:
+    Listener *listener;
+    std::vector<BoxHeader> stack; // open containers.
+    BoxHeader leaf;
+    uint64_t pos;
+    uint64_t remaining;
+    uint8_t hdr[16];
+    size_t hdr_len;
+    bool in_payload;
+    bool failed;
+
+    void startBox() {
+        BoxHeader h;
+        h.type = be32(hdr + 4);
+        h.header_size = hdr_len;
+        h.offset = pos - hdr_len;
+        h.size = be32(hdr);
+        if (hdr_len == 16) h.size = ((uint64_t)be32(hdr + 8) << 32) | be32(hdr + 12);
+        if (h.size == 0 && !stack.empty()) h.size = stack.back().offset + stack.back().size - h.offset; // to the end of the parent.
+        h.depth = stack.size();
+        h.container = has_child(h.type) && h.size != 0;
+        hdr_len = 0;
+        if (h.size != 0 && h.size < h.header_size) {
+            failed = true;
+            return;
+        }
+        if (!stack.empty() && h.size != 0 && h.offset + h.size > stack.back().offset + stack.back().size) {
+            failed = true;
+            return;
+        }
+
+        listener->boxStart(h);
+        if (h.container) {
+            stack.push_back(h);
+            closeContainers();
+            return;
+        }
+        leaf = h;
+        remaining = h.size - h.header_size;
+        in_payload = true;
+        if (h.size != 0 && remaining == 0) endLeaf();
+    }
+
+    void endLeaf() {
+        in_payload = false;
+        if (leaf.size == 0) leaf.size = pos - leaf.offset;
+        listener->boxEnd(leaf);
+        closeContainers();
+    }
+
+    void closeContainers() {
+        while (!stack.empty() && stack.back().offset + stack.back().size == pos) {
+            BoxHeader h = stack.back();
+            stack.pop_back();
+            listener->boxEnd(h);
+        }
+    }
+};
+
+// builds a box tree from push parser events. leaf boxes up to BOX_READ_SIZE_LIMIT
+// are buffered and decoded, larger ones become UnknownBoxRef (payload not kept, write() fails).
+// a size 0 box is created at its end, when the size is known.
+// all events are forwarded to next.
+class BoxTreeBuilder : public BoxPushParser::Listener {
+    std::vector<BoxSimpleList*> stack; // nullptr: children of a container that is not a BoxSimpleList, dropped.
+    Box *leaf;
+    bool open_ended; // size 0 leaf, body is buffered up to BOX_READ_SIZE_LIMIT.
+    std::vector<uint8_t> body;
+    BoxPushParser::Listener *next;
+    std::pmr::memory_resource *mr;
+public:
+    BoxTreeBuilder(BoxSimpleList &root, BoxPushParser::Listener *next = nullptr,
+                   std::pmr::memory_resource *mr = box_memory_resource()) : leaf(nullptr), open_ended(false), next(next), mr(mr) {
+        stack.push_back(&root);
+    }
+
+    void boxStart(const BoxHeader &h) {
+        BoxSimpleList *parent = stack.back();
+        if (parent == nullptr || h.size == 0) {
+            if (h.container) stack.push_back(nullptr);
+            open_ended = parent != nullptr;
+            body.clear();
+            if (next) next->boxStart(h);
+            return;
+        }
+        BoxAllocScope scope(mr);
+        Box *b = create(parent, h);
+        if (h.container) {
+            stack.push_back(dynamic_cast<BoxSimpleList*>(b));
+        } else if (dynamic_cast<UnknownBoxRef*>(b) == nullptr) {
+            leaf = b;
+            body.clear();
+            body.reserve(h.size - h.header_size);
+        }
+        if (next) next->boxStart(h);
+    }
+
+    void boxPayload(const BoxHeader &h, const uint8_t *data, size_t len) {
+        if (leaf != nullptr || (open_ended && body.size() + len <= BOX_READ_SIZE_LIMIT)) {
+            body.insert(body.end(), data, data + len);
+        }
+        if (next) next->boxPayload(h, data, len);
+    }
+
+    void boxEnd(const BoxHeader &h) {
+        if (h.container) {
+            stack.pop_back();
+        } else if (leaf != nullptr) {
+            BoxAllocScope scope(mr);
+            ByteReader r(body.data(), body.size());
+            leaf->decode(r);
+            leaf = nullptr;
+        } else if (open_ended) {
+            // size 0: created like any other box now that the size is known.
+            open_ended = false;
+            BoxAllocScope scope(mr);
+            Box *b = create(stack.back(), h);
+            if (dynamic_cast<UnknownBoxRef*>(b) == nullptr && body.size() == h.size - h.header_size) {
+                MemoryStreamBuf sb(body.data(), body.size(), false);
+                std::istream is(&sb);
+                b->parse(is);
+            }
+        }
+        if (next) next->boxEnd(h);
+    }
+
+private:
+    Box *create(BoxSimpleList *parent, const BoxHeader &h) {
+        Box *b = parent->createBox(h.type, h.size);
+        b->largesize = h.header_size == 16;
+        b->body_offset = h.offset + h.header_size;
+        if (auto ref = dynamic_cast<UnknownBoxRef*>(b)) ref->offset = b->body_offset;
+        parent->children.push_back(b);
+        return b;
+    }
+};
+
+// flat sample table of a track. struct of arrays, O(1) access by sample number.
+// built in one pass over stsc/stco/stsz/stts/ctts/stss.
+struct SampleIndex {
+    std::vector<uint64_t> offset; // file offset
+    std::vector<uint32_t> size;
+    std::vector<uint64_t> dts;
+    std::vector<int32_t> cts_offset; // empty if no ctts.
+    std::vector<uint8_t> sync;
+    std::vector<uint32_t> sync_samples; // sorted sync sample numbers. empty if all samples are sync.
+    uint32_t time_scale;
+
+    SampleIndex() : time_scale(1) {}
+    SampleIndex(Box *track) : time_scale(1) { build(track); }
+
+    size_t count() const {return size.size();}
+    bool hasCtsOffset() const {return !cts_offset.empty();}
+    int32_t ctsOffset(uint32_t n) const {return cts_offset.empty() ? 0 : cts_offset[n];}
+
+    // last sample with dts <= t. O(log n)
+    uint32_t sampleAtTime(uint64_t t) const {
+        size_t i = std::upper_bound(dts.begin(), dts.end(), t) - dts.begin();
+        return i > 0 ? i - 1 : 0;
+    }
+    // last sync sample <= n. O(log n)
+    uint32_t syncBefore(uint32_t n) const {
+        if (sync_samples.empty()) return n;
+        size_t i = std::upper_bound(sync_samples.begin(), sync_samples.end(), n) - sync_samples.begin();
+        return i > 0 ? sync_samples[i - 1] : sync_samples[0];
+    }
+    // first sync sample >= n. count() if none.
+    uint32_t syncAfter(uint32_t n) const {
+        if (sync_samples.empty()) return n < count() ? n : count();
+        size_t i = std::lower_bound(sync_samples.begin(), sync_samples.end(), n) - sync_samples.begin();
+        return i < sync_samples.size() ? sync_samples[i] : count();
+    }
+
+    bool build(Box *track) {
+        Box *stbl = track->find("mdia/minf/stbl");
+        if (stbl == nullptr) return false;
+        auto stsc = stbl->find<BoxSTSC>("stsc");
+        auto stss = stbl->find<BoxSTSS>("stss");
+        auto stsz = stbl->find<BoxSTSZ>("stsz");
+        auto stco = stbl->find<BoxSTCO>("stco");
+        if (stco == nullptr) stco = stbl->find<BoxSTCO>("co64");
+        auto stts = stbl->find<BoxSTTS>("stts");
+        auto ctts = stbl->find<BoxCTTS>("ctts");
+        auto mdhd = track->find<BoxMDHD>("mdia/mdhd");
+        offset.clear(); size.clear(); dts.clear(); cts_offset.clear(); sync.clear(); sync_samples.clear();
+        if (stsc == nullptr || stsz == nullptr || stco == nullptr || stts == nullptr) return false;
+        if (mdhd != nullptr) time_scale = mdhd->time_scale;
+
+        // tables are decoded in blocks (be32_decode). offsets are a prefix sum of sizes.
+        stsz->sizes(size);
+        uint32_t n = size.size();
+
+        // stsc runs -> chunk offsets. offset = chunk offset + sizes before the sample in the chunk.
+        offset.resize(n);
+        prefix_sum(offset.data(), size.data(), n, 0);
+        uint32_t chunks = stco->count();
+        uint32_t s = 0;
+        TableReader runs = stsc->entries();
+        std::vector<uint32_t> run; // first_chunk, samples_per_chunk, desc_index...
+        run.reserve(runs.remaining() * 3);
+        for (const uint32_t *e; size_t m = runs.next(e);) run.insert(run.end(), e, e + m * 3);
+        for (size_t r = 0; r < run.size() && s < n; r += 3) {
+            uint32_t last = r + 3 < run.size() ? run[r + 3] - 1 : chunks;
+            uint32_t spc = run[r + 1];
+            for (uint32_t ch = run[r] - 1; ch < last && ch < chunks && s < n; ch++) {
+                uint32_t e = std::min<uint64_t>((uint64_t)s + spc, n);
+                uint64_t base = stco->offset(ch) - offset[s];
+                for (; s < e; s++) offset[s] += base;
+            }
+        }
+        for (; s < n; s++) offset[s] = 0;
+
+        // stts runs -> dts
+        dts.resize(n);
+        TableReader deltas = stts->entries();
+        uint64_t t = 0;
+        s = 0;
+        for (const uint32_t *e; size_t m = deltas.next(e);) {
+            for (size_t i = 0; i < m && s < n; i++) {
+                uint32_t c = std::min(e[i * 2], n - s);
+                uint32_t d = e[i * 2 + 1];
+                uint64_t *p = &dts[s];
+                for (uint32_t k = 0; k < c; k++) p[k] = t + (uint64_t)k * d;
+                t += (uint64_t)c * d;
+                s += c;
+            }
+        }
+        std::fill(dts.begin() + s, dts.end(), t);
+
+        if (ctts != nullptr) {
+            cts_offset.resize(n);
+            TableReader offsets = ctts->entries();
+            s = 0;
+            for (const uint32_t *e; size_t m = offsets.next(e);) {
+                for (size_t i = 0; i < m && s < n; i++) {
+                    uint32_t c = std::min(e[i * 2], n - s);
+                    int32_t o = e[i * 2 + 1];
+                    for (uint32_t k = 0; k < c; k++) cts_offset[s + k] = o;
+                    s += c;
+                }
+            }
+            std::fill(cts_offset.begin() + s, cts_offset.end(), 0);
+        }
+
+        if (stss != nullptr) {
+            TableReader syncs = stss->syncs();
+            sync.assign(n, 0);
+            sync_samples.reserve(syncs.remaining());
+            for (const uint32_t *e; size_t m = syncs.next(e);) {
+                for (size_t i = 0; i < m; i++) {
+                    uint32_t v = e[i];
+                    if (v >= 1 && v <= n && !sync[v - 1]) {
+                        sync[v - 1] = 1;
+                        sync_samples.push_back(v - 1);
+                    }
+                }
+            }
+            if (!std::is_sorted(sync_samples.begin(), sync_samples.end())) {
+                std::sort(sync_samples.begin(), sync_samples.end());
+            }
+        } else {
+            sync.assign(n, 1);
+        }
+        return true;
+    }
+
+    // fragmented mp4. samples of track_id (0: the first track) in moov, then in every moof.
+    // a pre-scan: only top level box headers are read besides moov and moof, mdat payloads are skipped.
+    // offsets are absolute, dts continues over fragments without tfdt. moov is parsed into init if given.
+    // from: tfra entry to start at (FragmentRandomAccess), the fragments before its moof are skipped
+    // and the time of the entry is the start time if the moof has no tfdt.
+    bool buildFragmented(std::istream &is, uint32_t track_id = 0, Mp4Root *init = nullptr, const BoxTFRA::Entry *from = nullptr) {
+        Mp4Root local;
+        Mp4Root &root = init != nullptr ? *init : local;
+        offset.clear(); size.clear(); dts.clear(); cts_offset.clear(); sync.clear(); sync_samples.clear();
+        BoxTREX trex;
+        bool found = false;
+        uint64_t t = 0;
+        bool seek = false; // at the moof of from
+        std::vector<uint8_t> buf;
+
+        is.clear();
+        is.seekg(0, std::ios_base::end);
+        uint64_t end = is.tellg();
+        for (uint64_t pos = 0; pos + 8 <= end;) {
+            uint8_t h[16];
+            is.seekg(pos);
+            if (!is.read((char*)h, 8)) break;
+            uint64_t sz = be32(h);
+            uint32_t type = be32(h + 4);
+            size_t header = 8;
+            if (sz == 1) {
+                if (!is.read((char*)h + 8, 8)) break;
+                sz = be64(h + 8);
+                header = 16;
+            } else if (sz == 0) {
+                sz = end - pos;
+            }
+            if (sz < header || pos + sz > end) break;
+
+            if (type == BOX_MOOV || (type == BOX_MOOF && found)) {
+                buf.resize(sz);
+                memcpy(buf.data(), h, header);
+                if (!is.read((char*)buf.data() + header, sz - header)) break;
+            }
+            if (type == BOX_MOOV && !found) {
+                MemoryStreamBuf sb(buf.data(), buf.size(), false);
+                std::istream ms(&sb);
+                root.parse(ms);
+                Box *moov = root.find("moov");
+                for (int i = 0; moov != nullptr && !found && moov->child(BOX_TRAK, i) != nullptr; i++) {
+                    Box *trak = moov->child(BOX_TRAK, i);
+                    auto tkhd = trak->find<BoxTKHD>("tkhd");
+                    if (tkhd == nullptr || (track_id != 0 && tkhd->track_id != track_id)) continue;
+                    track_id = tkhd->track_id;
+                    found = true;
+                    build(trak);
+                    if (auto mdhd = trak->find<BoxMDHD>("mdia/mdhd")) time_scale = mdhd->time_scale;
+                    if (auto stts = trak->find<BoxSTTS>("mdia/minf/stbl/stts")) t = stts->sampleToTime(count()); // end of the moov samples
+                    if (sync_samples.empty()) { // all sync so far
+                        for (uint32_t s = 0; s < count(); s++) sync_samples.push_back(s);
+                    }
+                }
+                for (int i = 0; moov != nullptr && moov->find(std::string("mvex/trex[") + std::to_string(i) + "]") != nullptr; i++) {
+                    auto x = moov->find<BoxTREX>(std::string("mvex/trex[") + std::to_string(i) + "]");
+                    if (x != nullptr && x->track_id == track_id) trex = *x;
+                }
+            } else if (type == BOX_MOOF && found) {
+                size_t first = count();
+                bool tfdt = scanMoof(buf.data() + header, sz - header, pos, track_id, trex, t);
+                if (seek && !tfdt && first < count() && !cts_offset.empty()) {
+                    // tfra time is the presentation time of the sync sample.
+                    int32_t c = cts_offset[first];
+                    for (size_t i = first; i < count(); i++) dts[i] -= c;
+                    t -= c;
+                }
+                seek = false;
+            }
+            pos += sz;
+            if (found && from != nullptr && pos < from->moof_offset) {
+                pos = from->moof_offset;
+                t = from->time;
+                seek = true;
+            }
+        }
+        if (sync_samples.size() == count()) sync_samples.clear();
+        is.clear();
+        return found;
+    }
+
+private:
+    // child boxes in [p, p + n). f(type, payload, size)
+    template<typename F>
+    static void eachBox(const uint8_t *p, size_t n, F f) {
+        for (size_t pos = 0; pos + 8 <= n;) {
+            uint64_t sz = be32(p + pos);
+            size_t header = 8;
+            if (sz == 1 && pos + 16 <= n) {
+                sz = be64(p + pos + 8);
+                header = 16;
+            } else if (sz == 0) {
+                sz = n - pos;
+            }
+            if (sz < header || sz > n - pos) break;
+            f(be32(p + pos + 4), p + pos + header, (size_t)(sz - header));
+            pos += sz;
+        }
+    }
+
+    // returns true if a tfdt of the track set t.
+    bool scanMoof(const uint8_t *p, size_t n, uint64_t moof_pos, uint32_t track_id, const BoxTREX &trex, uint64_t &t) {
+        bool has_tfdt = false;
+        uint64_t data_end = moof_pos; // end of the previous traf's data
+        eachBox(p, n, [&](uint32_t type, const uint8_t *traf, size_t traf_size) {
+            if (type != BOX_TRAF) return;
+            BoxTFHD tfhd;
+            tfhd.flags = 0;
+            bool has_tfhd = false;
+            eachBox(traf, traf_size, [&](uint32_t type, const uint8_t *b, size_t n) {
+                ByteReader r(b, n);
+                if (type == BOX_TFHD) {
+                    tfhd.decode(r);
+                    has_tfhd = true;
+                } else if (type == BOX_TFDT && has_tfhd && tfhd.track_id == track_id) {
+                    BoxTFDT tfdt;
+                    tfdt.decode(r);
+                    t = tfdt.flag_start;
+                    has_tfdt = true;
+                }
+            });
+            if (!has_tfhd) return;
+            uint64_t base = data_end;
+            if (tfhd.flags & BoxTFHD::FLAG_BASE_DATA_OFFSET) {
+                base = tfhd.base_data_offset;
+            } else if (tfhd.flags & BoxTFHD::FLAG_DEFAULT_BASE_IS_MOOF) {
+                base = moof_pos;
+            }
+            uint32_t def_duration = tfhd.flags & BoxTFHD::FLAG_DEFAULT_DURATION ? tfhd.default_duration : trex.sample_duration;
+            uint32_t def_size = tfhd.flags & BoxTFHD::FLAG_DEFAULT_SIZE ? tfhd.default_size : trex.sample_size;
+            uint32_t def_flags = tfhd.flags & BoxTFHD::FLAG_DEFAULT_FLAGS ? tfhd.default_flags : trex.sample_flags;
+
+            uint64_t data = base;
+            eachBox(traf, traf_size, [&](uint32_t type, const uint8_t *b, size_t n) {
+                if (type != BOX_TRUN) return;
+                BoxTRUN trun(0);
+                ByteReader r(b, n);
+                trun.decode(r);
+                if (trun.flags & BoxTRUN::FLAG_DATA_OFFSET) data = base + trun.data_offset;
+                bool cts = (trun.flags & BoxTRUN::FLAG_SAMPLE_CTS) != 0;
+                if (track_id != tfhd.track_id) {
+                    for (int i = 0; i < trun.count(); i++) data += trun.sampleSize(i, def_size);
+                    return;
+                }
+                if (cts && cts_offset.empty()) cts_offset.assign(count(), 0);
+                for (int i = 0; i < trun.count(); i++) {
+                    uint32_t sz = trun.sampleSize(i, def_size);
+                    uint32_t f = trun.sampleFlags(i, def_flags);
+                    offset.push_back(data);
+                    size.push_back(sz);
+                    dts.push_back(t);
+                    if (cts || !cts_offset.empty()) cts_offset.push_back(cts ? trun.sampleCtsOffset(i) : 0);
+                    bool key = (f & 0x10000) == 0; // sample_is_non_sync_sample
+                    if (key) sync_samples.push_back(count() - 1);
+                    sync.push_back(key);
+                    data += sz;
+                    t += trun.sampleDuration(i, def_duration);
+                }
+            });
+            data_end = data;
+        });
+        return has_tfdt;
+    }
+
+public:
+};
+
+struct Sample {
+    uint64_t timestamp;
+    uint32_t time_scale;
+    uint32_t time_offset;
+    bool has_time_offset;
+    bool sync_point;
+    std::vector<uint8_t> data;
+};
+
+// samples are read in runs of contiguous samples (a chunk or adjacent chunks)
+// up to readBudget() bytes, one read per run.
+class Mp4SampleReader {
+    SampleIndex index;
+    uint32_t pos;
+    size_t budget;
+    std::vector<uint8_t> cache;
+    uint64_t cache_offset;
+public:
+    enum SeekMode {
+        SEEK_PREV_SYNC,    // last sync sample at or before t.
+        SEEK_NEAREST_SYNC, // sync sample closest to t.
+    };
+
+    Mp4SampleReader(isobmff::Box *track, size_t budget = 1 << 20) : index(track), pos(0), budget(budget), cache_offset(0) {}
+    explicit Mp4SampleReader(SampleIndex &&index, size_t budget = 1 << 20) : index(std::move(index)), pos(0), budget(budget), cache_offset(0) {}
+    bool eos() { return pos >= index.count(); }
+    bool syncPoint() { return pos < index.count() && index.sync[pos]; }
+    uint32_t timeScale() { return index.time_scale; }
+    uint32_t position() { return pos; }
+    const SampleIndex &sampleIndex() const { return index; }
+    void seek(uint32_t sample) { pos = sample; }
+    size_t readBudget() const { return budget; }
+    void setReadBudget(size_t bytes) { budget = bytes; }
+
+    // t: decode time in timeScale() units. returns new position.
+    uint32_t seekToTime(uint64_t t, SeekMode mode = SEEK_PREV_SYNC) {
+        if (index.count() == 0) return pos = 0;
+        uint32_t n = index.sampleAtTime(t);
+        uint32_t prev = index.syncBefore(n);
+        pos = prev;
+        if (mode == SEEK_NEAREST_SYNC) {
+            uint32_t next = index.syncAfter(n + 1);
+            uint64_t dp = index.dts[prev];
+            uint64_t before = dp <= t ? t - dp : dp - t;
+            if (next < index.count() && index.dts[next] - t < before) {
+                pos = next;
+            }
+        }
+        return pos;
+    }
+
+    Sample read(std::istream &is) {
+        return readRun([&](uint64_t offset, uint8_t *dst, size_t n) {
+            is.clear();
+            is.seekg(offset);
+            is.read((char*)dst, n);
+            return (size_t)is.gcount();
+        });
+    }
+
+    // pread from fd.
+    Sample read(int fd) {
+        return readRun([&](uint64_t offset, uint8_t *dst, size_t n) {
+            size_t done = 0;
+            while (done < n) {
+                ssize_t r = ::pread(fd, dst + done, n - done, offset + done);
+                if (r <= 0) break;
+                done += r;
+            }
+            return done;
+        });
+    }
+
+private:
+    // fill(offset, dst, n) -> bytes read.
+    template<typename F>
+    Sample readRun(F fill) {
+        Sample s;
+        s.timestamp = index.dts[pos];
+        s.time_scale = index.time_scale;
+        s.time_offset = index.ctsOffset(pos);
+        s.has_time_offset = index.hasCtsOffset();
+        s.sync_point = index.sync[pos] != 0;
+
+        uint64_t offset = index.offset[pos];
+        uint32_t size = index.size[pos];
+        if (offset < cache_offset || offset + size > cache_offset + cache.size()) {
+            // next run: samples following this one on disk.
+            uint64_t end = offset + size;
+            for (uint32_t i = pos + 1; i < index.count() && index.offset[i] == end
+                    && end + index.size[i] - offset <= budget; i++) {
+                end += index.size[i];
+            }
+            cache.resize(end - offset);
+            cache.resize(fill(offset, cache.data(), cache.size()));
+            cache_offset = offset;
+        }
+        if (offset + size <= cache_offset + cache.size()) {
+            const uint8_t *p = cache.data() + (offset - cache_offset);
+            s.data.assign(p, p + size);
+        }
+
+        pos ++;
+        return s;
+    }
+};
+
+// Mp4SampleReader over fragmented mp4. (SampleIndex::buildFragmented)
+class Mp4FragmentReader : public Mp4SampleReader {
+    static SampleIndex scan(std::istream &is, uint32_t track_id, Mp4Root *init) {
+        SampleIndex index;
+        index.buildFragmented(is, track_id, init);
+        return index;
+    }
+public:
+    // track_id 0: the first track. moov is parsed into init if given.
+    explicit Mp4FragmentReader(std::istream &is, uint32_t track_id = 0, Mp4Root *init = nullptr, size_t budget = 1 << 20)
+        : Mp4SampleReader(scan(is, track_id, init), budget) {}
+};
+
+// random access for fragmented mp4 (mfra at the end of the file).
+// only mfro (the last 16 bytes) and mfra are read, lookups are a binary search in tfra.
+class FragmentRandomAccess {
+    Mp4Root mfra;
+    std::vector<BoxTFRA*> tfra;
+public:
+    bool load(std::istream &is) {
+        mfra.clear();
+        tfra.clear();
+        uint8_t h[16];
+        is.clear();
+        is.seekg(0, std::ios_base::end);
+        uint64_t end = is.tellg();
+        if (end < sizeof(h)) return false;
+        is.seekg(end - sizeof(h));
+        if (!is.read((char*)h, sizeof(h)) || be32(h) != sizeof(h) || be32(h + 4) != BOX_MFRO) return false;
+        uint32_t size = be32(h + 12);
+        if (size < 8 + sizeof(h) || size > end) return false;
+        std::vector<uint8_t> buf(size);
+        is.seekg(end - size);
+        if (!is.read((char*)buf.data(), size) || be32(buf.data()) != size || be32(buf.data() + 4) != BOX_MFRA) return false;
+        MemoryStreamBuf sb(buf.data(), buf.size(), false);
+        std::istream ms(&sb);
+        mfra.parse(ms);
+        mfra.findAllByType(tfra, BOX_TFRA);
+        is.clear();
+        return true;
+    }
+
+    // track_id 0: the first tfra. nullptr if the track has no tfra.
+    const BoxTFRA *track(uint32_t track_id) const {
+        for (auto t : tfra) {
+            if (track_id == 0 || t->track_id == track_id) return t;
+        }
+        return nullptr;
+    }
+
+    // last random access point at or before t (track time scale). nullptr if none.
+    const BoxTFRA::Entry *entry(uint32_t track_id, uint64_t t) const {
+        const BoxTFRA *r = track(track_id);
+        int i = r != nullptr ? r->find(t) : -1;
+        return i >= 0 ? &r->entries[i] : nullptr;
+    }
+
+    // offset of the moof with the last random access point at or before t. -1 if none.
+    int64_t moofOffset(uint32_t track_id, uint64_t t) const {
+        const BoxTFRA::Entry *e = entry(track_id, t);
+        return e != nullptr ? (int64_t)e->moof_offset : -1;
+    }
+};
+
+// mfra for a fragmented file: tfra boxes (owned by the mfra after the call) + mfro, the mfra size
+// so that readers find it from the end.
+static inline void write_mfra(std::ostream &os, const std::vector<BoxTFRA*> &tfra) {
+    Mp4Root root;
+    auto mfra = root.adopt(new BoxSimpleList(BOX_MFRA));
+    for (auto t : tfra) mfra->adopt(t);
+    auto mfro = mfra->adopt(new BoxMFRO());
+    mfro->mfra_size = mfra->calcSize();
+    root.write(os);
+}
+
+enum FastStartResult {
+    FASTSTART_ERROR,
+    FASTSTART_DONE,
+    FASTSTART_ALREADY, // moov is already before mdat. nothing is written.
+};
+
+// moov-at-end file -> moov before the first mdat, for progressive download.
+// chunk offsets (stco/co64) into the moved range are shifted by the new moov size, offsets after
+// moov by the size change (co64 promotion, or bytes dropped when moov is parsed and written again).
+// everything but moov is copied in kernel, media data doesn't pass through user space.
+static inline FastStartResult faststart(const char *src, const char *dst) {
+    Mp4Root mp4;
+    if (!mp4.parseMapped(src, ParseOptions(true))) return FASTSTART_ERROR;
+    int moov = -1, mdat = -1;
+    for (int i = 0; i < (int)mp4.children.size(); i++) {
+        uint32_t t = mp4.children[i]->type;
+        if (t == BOX_MOOV && moov < 0) moov = i;
+        if (t == BOX_MDAT && mdat < 0) mdat = i;
+    }
+    if (moov < 0) return FASTSTART_ERROR;
+    if (mdat < 0 || moov < mdat) return FASTSTART_ALREADY;
+
+    Box *m = mp4.children[moov];
+    Box *d = mp4.children[mdat];
+    uint64_t insert_pos = d->body_offset - d->headerSize();
+    uint64_t moov_pos = m->body_offset - m->headerSize();
+    uint64_t old_size = m->size;
+    uint64_t moov_end = moov_pos + old_size;
+    uint64_t file_size = mp4.mappedFile()->size();
+
+    std::vector<BoxSTCO*> stcos;
+    m->findAllByType(stcos, BOX_STCO);
+    m->findAllByType(stcos, BOX_CO64);
+    std::vector<std::vector<uint64_t>> orig(stcos.size());
+    for (size_t j = 0; j < stcos.size(); j++) {
+        for (uint32_t i = 0; i < stcos[j]->count(); i++) orig[j].push_back(stcos[j]->offset(i));
+    }
+
+    // moov grows if a stco turns into co64 by the shift. repeat until the size is stable.
+    uint64_t delta = m->calcSize();
+    for (;;) {
+        for (size_t j = 0; j < stcos.size(); j++) {
+            for (size_t i = 0; i < orig[j].size(); i++) {
+                uint64_t o = orig[j][i];
+                if (o >= insert_pos && o < moov_pos) o += delta;
+                else if (o >= moov_end) o = o + delta - old_size;
+                stcos[j]->setOffset(i, o);
+            }
+        }
+        uint64_t sz = m->calcSize();
+        if (sz == delta) break;
+        delta = sz;
+    }
+    std::ostringstream os;
+    m->write(os);
+    const std::string moov_bytes = os.str();
+    if (moov_bytes.size() != delta) return FASTSTART_ERROR;
+
+    int in = mp4.mappedFile()->handle();
+    int out = ::open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) return FASTSTART_ERROR;
+    bool ok = copy_fd_range(out, in, 0, insert_pos)
+        && write_fd(out, moov_bytes.data(), moov_bytes.size())
+        && copy_fd_range(out, in, insert_pos, moov_pos - insert_pos)
+        && copy_fd_range(out, in, moov_end, file_size - moov_end);
+    if (::close(out) != 0) ok = false;
+    if (!ok) {
+        ::unlink(dst);
+        return FASTSTART_ERROR;
+    }
+    return FASTSTART_DONE;
+}
+
 static inline std::ostream& operator<<(std::ostream &os, const Box& b) {
     b.dump(os, "");
     return os;
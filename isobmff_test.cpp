@@ -3,11 +3,598 @@
 #include "isobmff.h"
 #include <fstream>
 #include <cassert>
+#include <sstream>
+#include <functional>
 
 using namespace std;
 using namespace isobmff;
 
+static void put_box(string &s, uint64_t size, const char *type, bool large = false) {
+    uint8_t h[16] = {0, 0, 0, 1};
+    int n = 8;
+    if (large) {
+        for (int i = 0; i < 8; i++) h[8 + i] = size >> (56 - i * 8);
+        n = 16;
+    } else {
+        for (int i = 0; i < 4; i++) h[i] = size >> (24 - i * 8);
+    }
+    memcpy(h + 4, type, 4);
+    s.append((const char*)h, n);
+}
+
+static string box(const char *type, const string &payload) {
+    string s;
+    put_box(s, 8 + payload.size(), type);
+    return s + payload;
+}
+
+static string u32s(initializer_list<uint32_t> values) {
+    string s;
+    for (uint32_t v : values) {
+        uint8_t b[4] = {(uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v};
+        s.append((const char*)b, 4);
+    }
+    return s;
+}
+
+// moov with two samples (durations 10 and 30) and trex defaults, then a fragment
+// whose tfhd has no defaults and no tfdt.
+static void test_fragment_defaults() {
+    string tkhd = box("tkhd", u32s({0, 0, 0, 1, 0, 40, 0, 0, 0, 0, 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000, 0, 0}));
+    string mdhd = box("mdhd", u32s({0, 0, 0, 1000, 40, 0}));
+    string stbl = box("stbl", box("stts", u32s({0, 2, 1, 10, 1, 30}))
+                            + box("stsc", u32s({0, 1, 1, 2, 1}))
+                            + box("stsz", u32s({0, 0, 2, 7, 9}))
+                            + box("stco", u32s({0, 1, 0})));
+    string trex = box("trex", u32s({0, 1, 1, 100, 6, 0x10000})); // duration 100, size 6, non sync
+    string moov = box("moov", box("trak", tkhd + box("mdia", mdhd + box("minf", stbl))) + box("mvex", trex));
+
+    // trun: data offset and sample sizes. duration and flags come from trex.
+    auto moof = [](uint32_t data_offset) {
+        string traf = box("tfhd", u32s({0x020000, 1})) // default-base-is-moof
+                    + box("trun", u32s({0x000201, 2, data_offset, 3, 4}));
+        return box("moof", box("mfhd", u32s({0, 1})) + box("traf", traf));
+    };
+    // truns without per sample fields: everything from trex. the second traf has no data offset,
+    // its data follows the first one's.
+    auto moof2 = [](uint32_t data_offset) {
+        string traf1 = box("tfhd", u32s({0x020000, 1})) + box("trun", u32s({0x000001, 2, data_offset}));
+        string traf2 = box("tfhd", u32s({0, 1})) + box("trun", u32s({0, 1}));
+        return box("moof", box("mfhd", u32s({0, 2})) + box("traf", traf1) + box("traf", traf2));
+    };
+    string data = moov + moof(moof(0).size() + 8) + box("mdat", string(7, 'x'))
+                + moof2(moof2(0).size() + 8) + box("mdat", string(18, 'y'));
+
+    Mp4Root root;
+    istringstream is(data);
+    root.parse(is);
+    assert(root.find("moov/mvex/trex") != nullptr);
+
+    SampleIndex index;
+    assert(index.buildFragmented(is));
+    assert(index.count() == 7);
+    uint64_t mdat = moov.size() + moof(0).size() + 8;
+    assert(index.dts[2] == 40); // after the moov samples
+    assert(index.dts[3] == 140); // trex duration
+    assert(index.size[2] == 3 && index.size[3] == 4);
+    assert(index.offset[2] == mdat && index.offset[3] == mdat + 3);
+    assert(index.sync[0] && !index.sync[2] && !index.sync[3]); // trex flags
+
+    uint64_t mdat2 = mdat + 15 + moof2(0).size();
+    for (int i = 0; i < 3; i++) {
+        assert(index.dts[4 + i] == 240 + i * 100);
+        assert(index.size[4 + i] == 6 && index.offset[4 + i] == mdat2 + i * 6);
+        assert(!index.sync[4 + i]);
+    }
+
+    // sample_count survives decode and encode without per sample fields.
+    string payload = u32s({0x000001, 30, 8});
+    BoxTRUN trun(8 + payload.size());
+    ByteReader r((const uint8_t*)payload.data(), payload.size());
+    trun.decode(r);
+    assert(trun.count() == 30 && trun.sampleSize(29, 6) == 6);
+    trun.calcSize();
+    ostringstream os;
+    trun.write(os);
+    assert(os.str() == box("trun", payload));
+}
+
+// samples in an mdat before moov and in one after it. moov has 4 bytes of padding that are dropped
+// when it is written again, so the data after moov moves too.
+static void test_faststart() {
+    string tkhd = box("tkhd", u32s({0, 0, 0, 1, 0, 30, 0, 0, 0, 0, 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000, 0, 0}));
+    string mdhd = box("mdhd", u32s({0, 0, 0, 1000, 30, 0}));
+    string ftyp = box("ftyp", "isom" + u32s({0}) + "isom");
+    string mdat1 = box("mdat", "AAAABBBB");
+    string mdat2 = box("mdat", "CCCCDD");
+    auto moov = [&](uint32_t chunk2) {
+        string stbl = box("stbl", box("stts", u32s({0, 1, 3, 10}))
+                                + box("stsc", u32s({0, 2, 1, 2, 1, 2, 1, 1}))
+                                + box("stsz", u32s({0, 0, 3, 4, 4, 6}))
+                                + box("stco", u32s({0, 2, (uint32_t)ftyp.size() + 8, chunk2})));
+        return box("moov", box("trak", tkhd + box("mdia", mdhd + box("minf", stbl))) + u32s({0}));
+    };
+    size_t moov_size = moov(0).size();
+    string src = ftyp + mdat1 + moov(ftyp.size() + mdat1.size() + moov_size + 8) + mdat2;
+    ofstream("faststart_src.mp4", ios::binary) << src;
+
+    assert(faststart("faststart_src.mp4", "faststart_dst.mp4") == FASTSTART_DONE);
+    ifstream ifs("faststart_dst.mp4", ios::binary);
+    string dst((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+    assert(dst.size() == src.size() - 4); // padding dropped
+
+    Mp4Root mp4;
+    istringstream is(dst);
+    mp4.parse(is);
+    assert(mp4.children.size() == 4 && mp4.children[1]->type == BOX_MOOV);
+    SampleIndex index(mp4.findByType(BOX_TRAK));
+    const char *expected[] = {"AAAA", "BBBB", "CCCCDD"};
+    assert(index.count() == 3);
+    for (int i = 0; i < 3; i++) {
+        assert(dst.compare(index.offset[i], index.size[i], expected[i]) == 0);
+    }
+    assert(faststart("faststart_dst.mp4", "faststart_dst2.mp4") == FASTSTART_ALREADY);
+}
+
+// feeds data in chunks of the given size and checks the tree is the same as the stream parser's.
+static void test_push_parser(const string &data, size_t chunk) {
+    Mp4Root pushed;
+    BoxTreeBuilder builder(pushed);
+    BoxPushParser parser(&builder);
+    for (size_t i = 0; i < data.size(); i += chunk) {
+        parser.feed((const uint8_t*)data.data() + i, min(chunk, data.size() - i));
+    }
+    parser.finish();
+    assert(!parser.error());
+    assert(parser.position() == data.size());
+
+    Mp4Root parsed;
+    istringstream is(data);
+    parsed.parse(is);
+    assert(pushed.children.size() == parsed.children.size());
+    for (size_t i = 0; i < parsed.children.size(); i++) {
+        assert(pushed.children[i]->type == parsed.children[i]->type);
+        assert(pushed.children[i]->size == parsed.children[i]->size);
+        assert(pushed.children[i]->children.size() == parsed.children[i]->children.size());
+    }
+
+    ostringstream os, expected;
+    pushed.write(os);
+    parsed.write(expected);
+    assert(os.str() == expected.str());
+}
+
+static void test_push_parser() {
+    string data;
+    put_box(data, 12, "free");
+    data += "abcd";
+    put_box(data, 8 + 18, "moov");
+    put_box(data, 18, "free", true); // largesize.
+    data += "xy";
+    put_box(data, 0, "mdat"); // to the end of stream.
+    data += "0123";
+
+    test_push_parser(data, 1); // every header split.
+    test_push_parser(data, 5);
+    test_push_parser(data, data.size());
+
+    // the size 0 box is written with its resolved size.
+    Mp4Root root;
+    BoxTreeBuilder builder(root);
+    BoxPushParser parser(&builder);
+    parser.feed((const uint8_t*)data.data(), data.size());
+    parser.finish();
+    assert(root.children.back()->type == BOX_MDAT && root.children.back()->size == 12);
+    ostringstream os;
+    root.write(os);
+    assert(os.str().size() == data.size() && os.str().compare(os.str().size() - 4, 4, "0123") == 0);
+}
+
+// the mapped parse gives the same tree and the same bytes as the stream parse.
+static void test_mapped_parse() {
+    ifstream ifs("test.mp4", ios::binary);
+    Mp4Root parsed;
+    parsed.parse(ifs);
+    Mp4Root mapped;
+    assert(mapped.parseMapped("test.mp4"));
+    assert(!mapped.parseMapped("no_such_file.mp4"));
+
+    ostringstream dump, dump_mapped;
+    dump << parsed;
+    dump_mapped << mapped;
+    assert(dump_mapped.str() == dump.str());
+
+    ostringstream os, os_mapped;
+    parsed.write(os);
+    mapped.write(os_mapped);
+    assert(os_mapped.str() == os.str());
+}
+
+// the flat index has the same samples as the per sample walk of the tables.
+static void test_sample_index(Box *track) {
+    SampleIndex index(track);
+    Box *stbl = track->find("mdia/minf/stbl");
+    auto stsc = stbl->find<BoxSTSC>("stsc");
+    auto stsz = stbl->find<BoxSTSZ>("stsz");
+    auto stco = stbl->find<BoxSTCO>("stco");
+    auto stts = stbl->find<BoxSTTS>("stts");
+    auto ctts = stbl->find<BoxCTTS>("ctts");
+    auto stss = stbl->find<BoxSTSS>("stss");
+    assert(index.count() == stsz->count() && index.count() > 0);
+    assert(index.hasCtsOffset() == (ctts != nullptr));
+
+    uint32_t chunk = UINT32_MAX;
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < index.count(); i++) {
+        uint32_t size = stsz->constantSize() ? stsz->constantSize() : stsz->size(i);
+        if (stsc->sampleToChunk(i) != chunk) {
+            chunk = stsc->sampleToChunk(i);
+            pos = stco->offset(chunk);
+        }
+        assert(index.size[i] == size);
+        assert(index.offset[i] == pos);
+        assert(index.dts[i] == stts->sampleToTime(i));
+        assert(index.ctsOffset(i) == (ctts ? (int32_t)ctts->sampleToOffset(i) : 0));
+        assert(index.sync[i] == (stss ? stss->include(i + 1) : 1));
+        pos += size;
+    }
+}
+
+// simd table decode and prefix sum give the scalar results, also for the tails.
+static void test_table_decode() {
+    vector<uint8_t> src(4 * 67);
+    for (size_t i = 0; i < src.size(); i++) src[i] = i * 37 + 11;
+    for (size_t n = 0; n <= 67; n++) {
+        vector<uint32_t> expected(n + 1, 0), out(n + 1, 0);
+        be32_decode_scalar(expected.data(), src.data(), n);
+        be32_decode(out.data(), src.data(), n);
+        assert(out == expected);
+#ifdef ISOBMFF_X86_SIMD
+        if (__builtin_cpu_supports("ssse3")) {
+            fill(out.begin(), out.end(), 0);
+            be32_decode_ssse3(out.data(), src.data(), n);
+            assert(out == expected);
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            fill(out.begin(), out.end(), 0);
+            be32_decode_avx2(out.data(), src.data(), n);
+            assert(out == expected);
+        }
+#endif
+
+        vector<uint64_t> sums(n + 1, 0);
+        uint64_t start = 0xfffffff0ull, total = prefix_sum(sums.data(), expected.data(), n, start);
+        for (size_t i = 0; i < n; i++) {
+            assert(sums[i] == start);
+            start += expected[i];
+        }
+        assert(total == start && sums[n] == 0);
+    }
+}
+
+// a stco offset past 4GiB turns the box into co64. 64bit box sizes are kept on write.
+static void test_large_offsets() {
+    BoxSTCO stco;
+    stco.add(100);
+    stco.add(200);
+    stco.calcSize();
+    assert(!stco.is64() && stco.size == 8 + 4 + 4 + 2 * 4);
+    stco.setOffset(1, 0x100000010ull);
+    stco.calcSize();
+    assert(stco.is64() && stco.type == BOX_CO64 && stco.size == 8 + 4 + 4 + 2 * 8);
+    assert(stco.offset(0) == 100 && stco.offset(1) == 0x100000010ull);
+    stco.moveAll(0x100000000ll);
+    assert(stco.offset(0) == 0x100000064ull);
+
+    ostringstream os;
+    stco.write(os);
+    Mp4Root root;
+    istringstream is(box("moov", box("trak", box("mdia", box("minf", box("stbl", os.str()))))));
+    root.parse(is);
+    auto co64 = root.find<BoxSTCO>("moov/trak/mdia/minf/stbl/co64");
+    assert(co64 != nullptr && co64->count() == 2 && co64->offset(1) == 0x200000010ull);
+
+    string data;
+    put_box(data, 16 + 4, "free", true);
+    data += "abcd";
+    put_box(data, 16 + 8 + 2, "moov", true);
+    put_box(data, 8 + 2, "free");
+    data += "xy";
+    Mp4Root large;
+    istringstream ls(data);
+    large.parse(ls);
+    assert(large.children.size() == 2 && large.children[0]->largesize && large.children[1]->largesize);
+    assert(large.children[1]->size == 26);
+    ostringstream out;
+    large.write(out);
+    assert(out.str() == data);
+
+    BoxFREE free(8);
+    assert(free.sizeFor(16) == 24 && !free.largesize);
+    assert(free.sizeFor(UINT32_MAX) == UINT32_MAX + 16ull && free.largesize);
+}
+
+// 10 samples, 10 apart. sync samples 0, 4 and 8.
+static void test_seek_to_time() {
+    auto make = [](initializer_list<uint32_t> syncs) {
+        SampleIndex index;
+        for (uint32_t i = 0; i < 10; i++) {
+            index.offset.push_back(i * 4);
+            index.size.push_back(4);
+            index.dts.push_back(i * 10);
+            index.sync.push_back(syncs.size() == 0);
+        }
+        for (uint32_t s : syncs) index.sync[s] = 1;
+        index.sync_samples = syncs;
+        return index;
+    };
+    Mp4SampleReader reader(make({0, 4, 8}));
+    assert(reader.seekToTime(55) == 4 && reader.position() == 4);
+    assert(reader.seekToTime(40) == 4);
+    assert(reader.seekToTime(39) == 0);
+    assert(reader.seekToTime(1000) == 8);
+    assert(reader.seekToTime(55, Mp4SampleReader::SEEK_NEAREST_SYNC) == 4);
+    assert(reader.seekToTime(65, Mp4SampleReader::SEEK_NEAREST_SYNC) == 8);
+    assert(reader.seekToTime(95, Mp4SampleReader::SEEK_NEAREST_SYNC) == 8);
+    assert(reader.seekToTime(15, Mp4SampleReader::SEEK_NEAREST_SYNC) == 0);
+
+    Mp4SampleReader all(make({}));
+    assert(all.seekToTime(35) == 3 && all.seekToTime(35, Mp4SampleReader::SEEK_NEAREST_SYNC) == 3);
+    Mp4SampleReader late(make({3}));
+    assert(late.seekToTime(0) == 3); // no sync sample before: the first one.
+    assert(late.syncPoint());
+}
+
+// lazy parse decodes only the filtered types up front, the rest on first use.
+static void test_lazy_parse() {
+    function<Box*(Box*, uint32_t)> peek = [&](Box *b, uint32_t type) -> Box* {
+        if (b->type == type) return b;
+        for (Box *c : b->children) {
+            if (Box *f = peek(c, type)) return f;
+        }
+        return nullptr;
+    };
+    ifstream ifs("test.mp4", ios::binary);
+    Mp4Root mp4;
+    mp4.parse(ifs, ParseOptions{"mvhd"});
+    assert(peek(&mp4, BOX_MVHD)->loaded());
+    Box *tkhd = peek(&mp4, BOX_TKHD);
+    assert(tkhd != nullptr && !tkhd->loaded());
+    assert(mp4.findByType(BOX_TKHD) == tkhd && tkhd->loaded());
+    assert(((BoxTKHD*)tkhd)->track_id == 1);
+
+    ifstream ifs2("test.mp4", ios::binary);
+    Mp4Root eager;
+    eager.parse(ifs2);
+    ostringstream os, expected;
+    mp4.write(os);
+    eager.write(expected);
+    assert(os.str() == expected.str());
+}
+
+// counts bytes in use.
+class CountingResource : public std::pmr::memory_resource {
+public:
+    size_t used = 0;
+private:
+    void *do_allocate(size_t n, size_t align) {
+        used += n;
+        return std::pmr::new_delete_resource()->allocate(n, align);
+    }
+    void do_deallocate(void *p, size_t n, size_t align) {
+        used -= n;
+        std::pmr::new_delete_resource()->deallocate(p, n, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept {return this == &other;}
+};
+
+// a tree parsed into a resource frees into it, also a box shared with a tree of another resource.
+static void test_memory_resource() {
+    CountingResource counter, other;
+    std::pmr::memory_resource *prev = box_memory_resource();
+    {
+        BoxSimpleList list(BOX_MOOV, 8, &other);
+        {
+            ifstream ifs("test.mp4", ios::binary);
+            Mp4Root mp4(&counter);
+            mp4.parse(ifs);
+            assert(box_memory_resource() == prev);
+            assert(counter.used > 0 && other.used == 0);
+            list.add(mp4.findByType(BOX_TRAK));
+            assert(other.used > 0);
+        }
+        assert(counter.used > 0); // the shared trak
+    }
+    assert(counter.used == 0 && other.used == 0);
+
+    std::pmr::monotonic_buffer_resource arena;
+    ifstream ifs("test.mp4", ios::binary);
+    Mp4Root mp4(&arena);
+    mp4.parse(ifs);
+    assert(mp4.findByType(BOX_MVHD) != nullptr);
+}
+
+// fourcc types and the box registry.
+static void test_box_registry() {
+    static_assert("moov"_4cc == 0x6d6f6f76 && BOX_MOOV == fourcc("moov"), "fourcc");
+    assert(fourcc_string("trak"_4cc) == "trak");
+
+    string data = box("wrap", box("free", "ab"));
+    auto parse = [&](Mp4Root &root) {
+        istringstream is(data);
+        root.parse(is);
+        assert(root.children.size() == 1 && root.children[0]->type == "wrap"_4cc);
+        return root.children[0];
+    };
+    Mp4Root unknown;
+    Box *b = parse(unknown);
+    assert(dynamic_cast<UnknownBox*>(b) != nullptr && b->children.empty());
+
+    BoxRegistry::instance().addContainer("wrap"_4cc);
+    Mp4Root container;
+    b = parse(container);
+    assert(b->children.size() == 1 && b->children[0]->type == BOX_FREE);
+    BoxRegistry::instance().remove("wrap"_4cc);
+    ostringstream os;
+    container.write(os);
+    assert(os.str() == data);
+
+    istringstream is(box("tkhd", u32s({0, 0, 0, 7, 0, 0, 0, 0, 0, 0, 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000, 0, 0})));
+    Mp4Root root;
+    root.parse(is);
+    auto tkhd = dynamic_cast<BoxTKHD*>(root.findByType(BOX_TKHD));
+    assert(tkhd != nullptr && tkhd->track_id == 7);
+}
+
+// index and path queries find the same boxes as the tree walk.
+static void test_box_index() {
+    ifstream ifs("test.mp4", ios::binary);
+    Mp4Root mp4;
+    mp4.parse(ifs);
+    const BoxIndex &index = mp4.buildIndex();
+    vector<Box*> tracks;
+    mp4.findAllByType(tracks, BOX_TRAK);
+    assert(tracks.size() > 1 && index.all(BOX_TRAK) == tracks);
+    assert(index.all("none"_4cc).empty());
+
+    for (size_t i = 0; i < tracks.size(); i++) {
+        auto stsz = (BoxSTSZ*)tracks[i]->findByType(BOX_STSZ);
+        assert(index.find<BoxSTSZ>(tracks[i], BOX_STSZ) == stsz);
+        assert(tracks[i]->find<BoxSTSZ>("mdia/minf/stbl/stsz") == stsz);
+        assert(mp4.find<BoxSTSZ>("moov/trak[" + to_string(i) + "]/mdia/minf/stbl/stsz") == stsz);
+        vector<BoxSTSZ*> all;
+        assert(index.findAll(all, tracks[i], BOX_STSZ).size() == 1 && all[0] == stsz);
+    }
+    assert(index.find<BoxSTCO>(tracks[0], BOX_STSZ) == nullptr); // type mismatch
+    assert(index.find(tracks[1], BOX_MVHD) == nullptr); // not in the subtree
+    assert(mp4.find("moov/trak[" + to_string(tracks.size()) + "]") == nullptr);
+    assert(mp4.find("moov/mvhd") == index.all(BOX_MVHD)[0]);
+}
+
+// big endian round trip. short reads and full fixed buffers fail without touching memory outside.
+static void test_byte_reader_writer() {
+    ByteWriter w;
+    w.u8(0x12);
+    w.u16(0x3456);
+    w.u24(0x789abc);
+    w.u32(0xdef01234);
+    w.u64(0x0123456789abcdefull);
+    w.bytes("xy", 2);
+    w.zero(3);
+    assert(!w.fail() && w.size() == 1 + 2 + 3 + 4 + 8 + 2 + 3);
+    assert(w.data()[0] == 0x12 && w.data()[1] == 0x34);
+
+    ByteReader r(w.data(), w.size());
+    assert(r.u8() == 0x12 && r.u16() == 0x3456 && r.u24() == 0x789abc);
+    assert(r.u32() == 0xdef01234 && r.u64() == 0x0123456789abcdefull);
+    char xy[2];
+    r.read(xy, 2);
+    assert(xy[0] == 'x' && xy[1] == 'y');
+    r.skip(3);
+    assert(!r.fail() && r.remaining() == 0);
+    assert(r.u32() == 0 && r.fail() && r.bytes(1) == nullptr);
+
+    uint8_t fixed[6] = {0, 0, 0, 0, 0, 0xee};
+    ByteWriter f(fixed, 5);
+    f.u32(1);
+    f.u16(2);
+    assert(f.fail() && f.size() == 4 && fixed[3] == 1 && fixed[4] == 0 && fixed[5] == 0xee);
+
+    // a truncated mvhd decodes what is there.
+    string payload = u32s({0, 1, 2, 600});
+    BoxMVHD mvhd(8 + payload.size());
+    ByteReader mr((const uint8_t*)payload.data(), payload.size());
+    mvhd.decode(mr);
+    assert(mr.fail() && mvhd.timeScale == 600 && mvhd.duration == 0);
+}
+
+// large box payloads are copied from the stream, from the mapping, or between fds.
+static void test_unknown_box_ref() {
+    string payload(3 * 1024 * 1024 + 5, 0);
+    for (size_t i = 0; i < payload.size(); i++) payload[i] = i % 251;
+    string data = box("mdat", payload);
+
+    istringstream is(data);
+    is.seekg(8);
+    UnknownBoxRef streamed(BOX_MDAT, data.size());
+    streamed.parse(is);
+    ostringstream os;
+    streamed.write(os);
+    assert(os.good() && os.str() == data);
+
+    ofstream("unknown_ref_src.mp4", ios::binary) << data;
+    MappedFile file("unknown_ref_src.mp4");
+    MemoryStreamBuf sb(file.data(), file.size(), true, file.handle());
+    istream ms(&sb);
+    ms.seekg(8);
+    UnknownBoxRef mapped(BOX_MDAT, data.size());
+    mapped.parse(ms);
+    assert(mapped.data == file.data() + 8 && mapped.fd == file.handle());
+    ostringstream os2;
+    mapped.write(os2);
+    assert(os2.good() && os2.str() == data);
+    {
+        FdStreamBuf out("unknown_ref_dst.mp4");
+        ostream fos(&out);
+        mapped.write(fos);
+        assert(fos.flush().good());
+    }
+    ifstream ifs("unknown_ref_dst.mp4", ios::binary);
+    assert(string((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>()) == data);
+
+    UnknownBoxRef detached(BOX_MDAT, data.size());
+    ostringstream os3;
+    detached.write(os3);
+    assert(os3.fail());
+}
+
+// counts seeks, one per read of the sample reader.
+class SeekCountBuf : public std::stringbuf {
+public:
+    int seeks = 0;
+    explicit SeekCountBuf(const string &s) : std::stringbuf(s, ios::in) {}
+protected:
+    pos_type seekpos(pos_type pos, ios::openmode which) {
+        seeks++;
+        return std::stringbuf::seekpos(pos, which);
+    }
+};
+
+// samples read in runs are the samples read one by one, with fewer reads.
+static void test_sample_runs(Box *track, const string &file) {
+    SampleIndex index(track);
+    SeekCountBuf single_buf(file), run_buf(file);
+    istream single_is(&single_buf), run_is(&run_buf);
+    Mp4SampleReader single(track, 0), runs(track);
+    int fd = open("test.mp4", O_RDONLY);
+    assert(fd >= 0);
+    Mp4SampleReader pread_runs(track, 4096);
+    for (uint32_t i = 0; i < index.count(); i++) {
+        Sample a = single.read(single_is), b = runs.read(run_is), c = pread_runs.read(fd);
+        assert(a.data.size() == index.size[i]);
+        assert(file.compare(index.offset[i], index.size[i], string(a.data.begin(), a.data.end())) == 0);
+        assert(a.data == b.data && a.data == c.data);
+        assert(a.timestamp == b.timestamp && a.sync_point == b.sync_point);
+    }
+    close(fd);
+    assert(runs.eos() && single_buf.seeks == (int)index.count());
+    assert(run_buf.seeks > 0 && run_buf.seeks < single_buf.seeks);
+}
+
 int main() {
+    test_push_parser();
+    test_fragment_defaults();
+    test_faststart();
+    test_mapped_parse();
+    test_table_decode();
+    test_large_offsets();
+    test_seek_to_time();
+    test_lazy_parse();
+    test_memory_resource();
+    test_box_registry();
+    test_box_index();
+    test_byte_reader_writer();
+    test_unknown_box_ref();
 
     ifstream ifs("test.mp4", ios::binary);
 
@@ -21,9 +608,13 @@ int main() {
     cout << "duration: " << (double)mvhd->duration / mvhd->timeScale << "sec. (" << mvhd->duration << "/" <<  mvhd->timeScale << endl;
 
     // get tracks
+    ifstream src("test.mp4", ios::binary);
+    string file((istreambuf_iterator<char>(src)), istreambuf_iterator<char>());
     vector<Box*> tracks;
     mp4.findAllByType(tracks, BOX_TRAK);
     for (auto track : tracks) {
+        test_sample_index(track);
+        test_sample_runs(track, file);
 
         auto tkhd = (BoxTKHD*)track->findByType(BOX_TKHD);
         assert(tkhd != nullptr);
@@ -48,7 +639,7 @@ int main() {
     //}
 
     ofstream ofs("out.mp4", ios::binary);
-    mp4.write(ofs); // skip mdat, if large.
+    mp4.write(ofs); // large boxes (mdat) are copied from ifs.
 
     return 0;
 }
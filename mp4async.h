@@ -0,0 +1,438 @@
+// asynchronous sample reads (io_uring)
+
+#ifndef MP4ASYNC_H_
+#define MP4ASYNC_H_
+
+#include "isobmff.h"
+#include <deque>
+#include <functional>
+#include <cerrno>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define ISOBMFF_IO_URING 1
+#endif
+#endif
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define ISOBMFF_COROUTINE 1
+#endif
+#endif
+
+namespace isobmff {
+
+// queue of file reads. io_uring if the kernel has it, blocking pread otherwise.
+// callbacks run in poll() on the calling thread. not thread safe.
+class AsyncIO {
+public:
+    typedef std::function<void(ssize_t)> Callback; // bytes read or -errno
+
+    // use_io_uring false: blocking pread even if io_uring is available.
+    explicit AsyncIO(unsigned depth = 64, bool use_io_uring = true) : depth(std::max(depth, 1u)), inflight(0), unsubmitted(0) {
+#ifdef ISOBMFF_IO_URING
+        if (use_io_uring) setup();
+#else
+        (void)use_io_uring;
+#endif
+    }
+    AsyncIO(const AsyncIO&) = delete;
+    AsyncIO& operator=(const AsyncIO&) = delete;
+    ~AsyncIO() {
+        drain();
+#ifdef ISOBMFF_IO_URING
+        if (sq_ptr != nullptr) ::munmap(sq_ptr, sq_size);
+        if (cq_ptr != nullptr && cq_ptr != sq_ptr) ::munmap(cq_ptr, cq_size);
+        if (sqes != nullptr) ::munmap(sqes, sqe_count * sizeof(io_uring_sqe));
+        if (ring >= 0) ::close(ring);
+#endif
+    }
+
+    // false: blocking fallback.
+    bool isAsync() const {
+#ifdef ISOBMFF_IO_URING
+        return ring >= 0;
+#else
+        return false;
+#endif
+    }
+    unsigned queueDepth() const {return depth;}
+    size_t pending() const {return inflight + waiting.size() + done.size();}
+
+    // read n bytes at offset of fd into dst. dst must live until the callback.
+    void read(int fd, void *dst, size_t n, uint64_t offset, Callback cb) {
+        Op op = {fd, (uint8_t*)dst, n, offset, 0, std::move(cb)};
+#ifdef ISOBMFF_IO_URING
+        if (isAsync()) {
+            waiting.push_back(std::move(op));
+            submit();
+            return;
+        }
+#endif
+        ssize_t r = pread_all(op);
+        done.emplace_back(std::move(op.cb), r);
+    }
+
+    // submit queued reads and run callbacks of completed ones.
+    // wait: block until at least one completes. returns callbacks run.
+    size_t poll(bool wait = false) {
+        std::deque<std::pair<Callback, ssize_t>> ready;
+        ready.swap(done);
+#ifdef ISOBMFF_IO_URING
+        if (isAsync()) {
+            submit();
+            reap(ready, wait && ready.empty() && inflight > 0);
+        }
+#endif
+        for (auto &c : ready) {
+            c.first(c.second);
+        }
+        return ready.size();
+    }
+
+    // run until nothing is pending.
+    void drain() {
+        while (pending() > 0) poll(true);
+    }
+
+private:
+    struct Op {
+        int fd;
+        uint8_t *dst;
+        size_t size;
+        uint64_t offset;
+        size_t done;
+        Callback cb;
+    };
+
+    unsigned depth;
+    size_t inflight;
+    unsigned unsubmitted;
+    std::deque<Op> waiting; // over queue depth
+    std::deque<std::pair<Callback, ssize_t>> done;
+
+    static ssize_t pread_all(Op &op) {
+        while (op.done < op.size) {
+            ssize_t r = ::pread(op.fd, op.dst + op.done, op.size - op.done, op.offset + op.done);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) return -errno;
+            if (r == 0) break;
+            op.done += r;
+        }
+        return op.done;
+    }
+
+#ifdef ISOBMFF_IO_URING
+    int ring = -1;
+    void *sq_ptr = nullptr;
+    void *cq_ptr = nullptr;
+    size_t sq_size = 0, cq_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    unsigned sqe_count = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    std::vector<Op> ops; // by user_data
+    std::vector<uint32_t> free_ops;
+
+    void setup() {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring = ::syscall(__NR_io_uring_setup, depth, &p);
+        if (ring < 0) return;
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ptr = ::mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) sq_ptr = nullptr;
+        cq_ptr = single ? sq_ptr : ::mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) cq_ptr = nullptr;
+        sqe_count = p.sq_entries;
+        void *s = ::mmap(nullptr, sqe_count * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+        sqes = s == MAP_FAILED ? nullptr : (io_uring_sqe*)s;
+        if (sq_ptr == nullptr || cq_ptr == nullptr || sqes == nullptr) {
+            if (sq_ptr != nullptr) ::munmap(sq_ptr, sq_size);
+            if (cq_ptr != nullptr && cq_ptr != sq_ptr) ::munmap(cq_ptr, cq_size);
+            if (sqes != nullptr) ::munmap(sqes, sqe_count * sizeof(io_uring_sqe));
+            sq_ptr = cq_ptr = nullptr;
+            sqes = nullptr;
+            ::close(ring);
+            ring = -1;
+            return;
+        }
+        uint8_t *sq = (uint8_t*)sq_ptr, *cq = (uint8_t*)cq_ptr;
+        sq_head = (unsigned*)(sq + p.sq_off.head);
+        sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + p.sq_off.array);
+        cq_head = (unsigned*)(cq + p.cq_off.head);
+        cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        depth = std::min(depth, sqe_count); // completions never overflow the cq (2 * sq entries).
+    }
+
+    void push(uint32_t id) {
+        const Op &op = ops[id];
+        unsigned tail = *sq_tail;
+        unsigned i = tail & *sq_mask;
+        io_uring_sqe *sqe = &sqes[i];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = op.fd;
+        sqe->addr = (uint64_t)(uintptr_t)(op.dst + op.done);
+        sqe->len = std::min<size_t>(op.size - op.done, 1u << 30);
+        sqe->off = op.offset + op.done;
+        sqe->user_data = id;
+        sq_array[i] = i;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+        inflight++;
+    }
+
+    void submit() {
+        while (!waiting.empty() && inflight < depth) {
+            uint32_t id;
+            if (free_ops.empty()) {
+                id = ops.size();
+                ops.emplace_back();
+            } else {
+                id = free_ops.back();
+                free_ops.pop_back();
+            }
+            ops[id] = std::move(waiting.front());
+            waiting.pop_front();
+            push(id);
+        }
+        enter(0);
+    }
+
+    void enter(unsigned min_complete) {
+        if (unsubmitted == 0 && min_complete == 0) return;
+        unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int r = ::syscall(__NR_io_uring_enter, ring, unsubmitted, min_complete, flags, nullptr, 0);
+        if (r >= 0) {
+            unsubmitted -= std::min<unsigned>(r, unsubmitted);
+        }
+    }
+
+    void reap(std::deque<std::pair<Callback, ssize_t>> &ready, bool wait) {
+        if (wait) enter(1);
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe &cqe = cqes[head & *cq_mask];
+            uint32_t id = cqe.user_data;
+            int res = cqe.res;
+            inflight--;
+            Op &op = ops[id];
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                res = pread_all(op); // old kernel without IORING_OP_READ.
+            } else if (res > 0) {
+                op.done += res;
+                if (op.done < op.size) { // short read, rest of it.
+                    push(id);
+                    continue;
+                }
+                res = op.done;
+            } else if (res == 0) {
+                res = op.done;
+            }
+            ready.emplace_back(std::move(op.cb), res);
+            op.cb = nullptr;
+            free_ops.push_back(id);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        submit();
+    }
+#endif
+};
+
+// Mp4SampleReader-like cursor over AsyncIO.
+// runs of contiguous samples (up to budget bytes) are read ahead, `ahead` runs in flight.
+// samples are delivered in read order from AsyncIO::poll().
+class AsyncSampleReader {
+public:
+    typedef std::function<void(Sample&&)> SampleCallback;
+
+    AsyncSampleReader(Box *track, AsyncIO &io, int fd, unsigned ahead = 8, size_t budget = 1 << 20)
+        : index(track), io(io), fd(fd), ahead(std::max(ahead, 1u)), budget(budget),
+          pos(0), next_issue(0), inflight(0), delivering(false) {}
+    AsyncSampleReader(const AsyncSampleReader&) = delete;
+    AsyncSampleReader& operator=(const AsyncSampleReader&) = delete;
+    ~AsyncSampleReader() {
+        waiters.clear();
+        runs.clear();
+        while (inflight > 0) io.poll(true);
+    }
+
+    bool eos() const { return pos >= index.count(); }
+    bool syncPoint() const { return pos < index.count() && index.sync[pos]; }
+    uint32_t timeScale() const { return index.time_scale; }
+    uint32_t position() const { return pos; }
+    const SampleIndex &sampleIndex() const { return index; }
+
+    // drops read ahead. queued reads are still delivered.
+    void seek(uint32_t sample) {
+        pos = sample;
+        next_issue = sample;
+        if (waiters.empty()) runs.clear();
+    }
+
+    // callback API. cb gets the sample at position() from io.poll() (or right away if it's read).
+    void read(SampleCallback cb) {
+        waiters.push_back({pos++, std::move(cb)});
+        fill();
+        deliver();
+    }
+
+    // blocking.
+    Sample read() {
+        Sample s;
+        bool got = false;
+        read([&](Sample &&r) { s = std::move(r); got = true; });
+        while (!got && io.pending() > 0) io.poll(true);
+        return s;
+    }
+
+#ifdef ISOBMFF_COROUTINE
+    // awaitable. resumed from io.poll().  Sample s = co_await reader.next();
+    struct NextSample {
+        AsyncSampleReader *reader;
+        Sample sample{};
+        bool ready = false;
+        std::coroutine_handle<> handle{};
+
+        bool await_ready() {
+            reader->read([this](Sample &&s) {
+                sample = std::move(s);
+                ready = true;
+                if (handle) handle.resume();
+            });
+            return ready;
+        }
+        void await_suspend(std::coroutine_handle<> h) { handle = h; }
+        Sample await_resume() { return std::move(sample); }
+    };
+    NextSample next() { return NextSample{this}; }
+#endif
+
+private:
+    struct Run {
+        uint32_t first, last;
+        uint64_t offset;
+        std::vector<uint8_t> buf;
+        ssize_t result;
+        bool done;
+    };
+    struct Waiter {
+        uint32_t sample;
+        SampleCallback cb;
+    };
+
+    SampleIndex index;
+    AsyncIO &io;
+    int fd;
+    unsigned ahead;
+    size_t budget;
+    uint32_t pos;
+    uint32_t next_issue;
+    size_t inflight; // the reader waits for its reads, runs dropped by seek may still be in flight.
+    bool delivering;
+    std::deque<std::shared_ptr<Run>> runs;
+    std::deque<Waiter> waiters;
+
+    // read run from sample s. returns the sample after it.
+    uint32_t issue(uint32_t s) {
+        auto run = std::make_shared<Run>();
+        run->first = s;
+        run->offset = index.offset[s];
+        uint64_t end = run->offset + index.size[s];
+        for (s++; s < index.count() && index.offset[s] == end && end + index.size[s] - run->offset <= budget; s++) {
+            end += index.size[s];
+        }
+        run->last = s;
+        run->buf.resize(end - run->offset);
+        run->result = 0;
+        run->done = false;
+        runs.push_back(run);
+        inflight++;
+        io.read(fd, run->buf.data(), run->buf.size(), run->offset, [this, run](ssize_t r) {
+            inflight--;
+            run->result = r;
+            run->done = true;
+            if (run.use_count() > 1) { // still in runs.
+                deliver();
+                fill();
+            }
+        });
+        return s;
+    }
+
+    void fill() {
+        while (runs.size() < ahead && next_issue < index.count()) {
+            next_issue = issue(next_issue);
+        }
+    }
+
+    std::shared_ptr<Run> find(uint32_t s) {
+        for (auto &r : runs) {
+            if (r->first <= s && s < r->last) return r;
+        }
+        return nullptr;
+    }
+
+    void deliver() {
+        if (delivering) return; // callbacks may read again. the outer loop picks it up.
+        delivering = true;
+        while (!waiters.empty()) {
+            uint32_t s = waiters.front().sample;
+            if (s >= index.count()) {
+                trim();
+                Waiter w = std::move(waiters.front());
+                waiters.pop_front();
+                w.cb(Sample());
+                continue;
+            }
+            auto run = find(s);
+            if (run == nullptr) {
+                issue(s);
+                break;
+            }
+            if (!run->done) break;
+
+            Sample sample;
+            sample.timestamp = index.dts[s];
+            sample.time_scale = index.time_scale;
+            sample.time_offset = index.ctsOffset(s);
+            sample.has_time_offset = index.hasCtsOffset();
+            sample.sync_point = index.sync[s] != 0;
+            uint64_t o = index.offset[s] - run->offset;
+            if (run->result >= 0 && o + index.size[s] <= (uint64_t)run->result) {
+                sample.data.assign(run->buf.begin() + o, run->buf.begin() + o + index.size[s]);
+            }
+            Waiter w = std::move(waiters.front());
+            waiters.pop_front();
+            trim();
+            fill();
+            w.cb(std::move(sample));
+        }
+        delivering = false;
+    }
+
+    // drop runs before the next sample to deliver.
+    void trim() {
+        uint32_t s = waiters.empty() ? pos : waiters.front().sample;
+        while (!runs.empty() && runs.front()->last <= s) {
+            runs.pop_front();
+        }
+    }
+};
+
+} // namespace isobmff
+
+#endif
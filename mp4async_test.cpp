@@ -0,0 +1,55 @@
+#include "mp4async.h"
+#include <iostream>
+#include <cassert>
+
+using namespace std;
+using namespace isobmff;
+
+static void assert_same(const Sample &a, const Sample &b) {
+    assert(a.timestamp == b.timestamp);
+    assert(a.time_scale == b.time_scale);
+    assert(a.time_offset == b.time_offset);
+    assert(a.has_time_offset == b.has_time_offset);
+    assert(a.sync_point == b.sync_point);
+    assert(a.data == b.data);
+}
+
+// every sample of the track in order (callbacks), then after a seek (blocking read).
+static void test_reader(Box *track, int fd, bool use_io_uring) {
+    AsyncIO io(16, use_io_uring);
+    if (!use_io_uring) assert(!io.isAsync());
+    AsyncSampleReader reader(track, io, fd, 4, 64 * 1024);
+    Mp4SampleReader expected(track);
+
+    vector<Sample> samples;
+    while (!reader.eos()) {
+        reader.read([&](Sample &&s) { samples.push_back(std::move(s)); });
+    }
+    io.drain();
+    assert(samples.size() == expected.sampleIndex().count());
+    for (auto &s : samples) assert_same(s, expected.read(fd));
+
+    uint32_t n = samples.size() / 2;
+    reader.seek(n);
+    expected.seek(n);
+    for (int i = 0; i < 10 && !expected.eos(); i++) assert_same(reader.read(), expected.read(fd));
+}
+
+int main() {
+    Mp4Root mp4;
+    assert(mp4.parseMapped("test.mp4"));
+    int fd = open("test.mp4", O_RDONLY);
+    assert(fd >= 0);
+
+    vector<Box*> tracks;
+    mp4.findAllByType(tracks, BOX_TRAK);
+    assert(!tracks.empty());
+    for (auto track : tracks) {
+        test_reader(track, fd, true); // pread if the kernel has no io_uring
+        test_reader(track, fd, false);
+    }
+    close(fd);
+
+    cout << "ok" << endl;
+    return 0;
+}
@@ -1,274 +1,146 @@
-#include "isobmff.h"
+#include "mp4dash.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
 
 using namespace std;
 using namespace isobmff;
 
-struct Sample {
-    uint64_t timestamp;
-    uint32_t time_scale;
-    uint32_t time_offset;
-    bool has_time_offset;
-    bool sync_point;
-    std::vector<uint8_t> data;
+// the source tree is only read here, so tracks can be converted on threads.
+struct Options {
+    int chunk_ms = 0; // LL-CMAF chunk duration. 0: a moof per segment.
+    bool single = false; // a file per track (on-demand profile).
+    int segments_per_index = 0; // hierarchical sidx in single file mode.
 };
 
-class Mp4SampleReader {
-    Box *track;
-    BoxSTSC *stsc;
-    BoxSTSD *stsd;
-    BoxSTSS *stss;
-    BoxSTSZ *stsz;
-    BoxSTCO *stco;
-    BoxSTTS *stts;
-    BoxCTTS *ctts;
-    uint32_t pos;
-    uint32_t read_offset;
-    uint32_t current_chunk;
-    uint32_t time_scale;
-public:
-    Mp4SampleReader(isobmff::Box *track) : track(track) {
-        stsc = (BoxSTSC*)track->findByType(BOX_STSC);
-        stss = (BoxSTSS*)track->findByType(BOX_STSS);
-        stsd = (BoxSTSD*)track->findByType(BOX_STSD);
-        stsz = (BoxSTSZ*)track->findByType(BOX_STSZ);
-        stco = (BoxSTCO*)track->findByType(BOX_STCO);
-        stts = (BoxSTTS*)track->findByType(BOX_STTS);
-        ctts = (BoxCTTS*)track->findByType(BOX_CTTS);
-        auto mdhd = (BoxMDHD*)track->findByType(BOX_MDHD);
-        time_scale = mdhd->time_scale;
-        pos = 0;
-        read_offset = 0;
-        current_chunk = -1;
-    }
-    bool eos() { return pos >= stsz->count(); }
-    bool syncPoint() { return (stss == nullptr) || stss->include(pos + 1);}
-    uint32_t timeScale() { return  time_scale;}
-    uint32_t position() { return pos; }
-    void seek(uint32_t sample) {
-        current_chunk = stsc->sampleToChunk(sample);
-        pos = sample;
-        read_offset = 0;
-        while (sample > 0) {
-            sample--;
-            if (stsc->sampleToChunk(sample) != current_chunk) break;
-            read_offset += stsz->size(sample);
-        }
-    }
-    Sample read(std::istream &is) {
-        auto chunk = stsc->sampleToChunk(pos);
-        if (current_chunk != chunk) {
-            current_chunk = chunk;
-            read_offset = 0;
-        }
-        Sample s;
-        s.timestamp = stts->sampleToTime(pos);
-        s.time_scale = time_scale;
-        s.time_offset = 0;
-        s.has_time_offset = false;
-        s.sync_point = syncPoint();
-        if (ctts != nullptr) {
-            s.time_offset = ctts->sampleToOffset(pos);
-            s.has_time_offset = true;
-        }
-
-        // read
-        s.data.resize(stsz->size(pos));
-        is.seekg(stco->offset(chunk) + read_offset);
-        is.read((char*)&s.data[0], s.data.size());
+int convert(const MappedFile &file, const BoxIndex &index, Box *track, int track_idx, const Options &opt, DashRepresentation &rep, ostream &log) {
 
-        read_offset += stsz->size(pos);
-        pos ++;
-        return s;
-    }
-};
-
-
-int convert(istream &ifs, Box *track, int track_idx) {
-
-    auto mdhd = (BoxMDHD*)track->findByType(BOX_MDHD);
-    cout << "duration: " << mdhd->duration / mdhd->time_scale
+    auto mdhd = index.find<BoxMDHD>(track, BOX_MDHD);
+    log << "duration: " << mdhd->duration / mdhd->time_scale
          << "sec. (" << mdhd->duration << "/" <<  mdhd->time_scale << endl;
 
-    auto tkhd = (BoxTKHD*)track->findByType(BOX_TKHD);
-    auto hdlr = (BoxHDLR*)track->findByType(BOX_HDLR);
-    auto stsd = (BoxSTSD*)track->findByType(BOX_STSD);
-    cout << "resoluion: " << tkhd->width/65536 << "x" <<  tkhd->width/65536 << endl;
-    cout << "type:" << hdlr->typeAsString() << " (" << hdlr->name() << ")" << endl;
+    auto tkhd = index.find<BoxTKHD>(track, BOX_TKHD);
+    auto hdlr = index.find<BoxHDLR>(track, BOX_HDLR);
+    auto stsd = index.find<BoxSTSD>(track, BOX_STSD);
+    log << "resoluion: " << tkhd->width/65536 << "x" <<  tkhd->width/65536 << endl;
+    log << "type:" << hdlr->typeAsString() << " (" << hdlr->name() << ")" << endl;
 
-    cout << "type: " << stsd->typeAsString() << "  config_size:" << stsd->desc().size() << endl;
+    log << "type: " << stsd->typeAsString() << "  config_size:" << stsd->desc().size() << endl;
 
-    ifs.clear();
     Mp4SampleReader reader(track);
 
     uint32_t timeScale = reader.timeScale();
 
-    // write init
-    {
-        Mp4Root m4s;
-        BoxFTYP *oftyp = new BoxFTYP(0);
-        m4s.add(oftyp);
-        memcpy(oftyp->major, "iso5", 4);
-        oftyp->minor = 512;
-        oftyp->compat.push_back(0x366f7369); // iso6
-        oftyp->compat.push_back(0x3134706d); // mp41
-
-        BoxSimpleList *omoov = new BoxSimpleList(BOX_MOOV);
-        m4s.add(omoov);
-
-        BoxMVHD *omvhd = new BoxMVHD();
-        omoov->add(omvhd);
-        omvhd->init();
-        omvhd->duration = 0;
-        omvhd->timeScale = timeScale;
-
-        BoxSimpleList *otrack = new BoxSimpleList(BOX_TRAK);
-        BoxTKHD *otkhd = new BoxTKHD();
-        otkhd->init();
-        otkhd->volume = tkhd->volume;
-        otkhd->width = tkhd->width;
-        otkhd->height = tkhd->height;
-        otrack->add(otkhd);
-        // otrack->add(track->findByType("edts")); // TODO
-        omoov->add(otrack);
-
-        BoxSimpleList *omdia = new BoxSimpleList(BOX_MDIA);
-        BoxMDHD *omdhd = new BoxMDHD();
-        omdhd->time_scale = timeScale;
-        omdia->add(omdhd);
-        omdia->add(hdlr); // TODO
-        otrack->add(omdia);
-
-        BoxSimpleList *ominf = new BoxSimpleList(BOX_MINF);
-        omdia->add(ominf);
-        //if (track->findByType("vmhd") != nullptr) {
-        //    ominf->add(track->findByType("vmhd"));
-        //}
-        //ominf->add(track->findByType("dinf"));
+    const SampleIndex &samples = reader.sampleIndex();
+    vector<uint32_t> segments = plan_segments(samples, 5 * timeScale);
+    rep = DashRepresentation(track);
+    rep.id = "stream" + to_string(track_idx);
 
-        auto ostbl = new BoxSimpleList(BOX_STBL);
-        ominf->add(ostbl);
-
-        ostbl->add(stsd);
-
-        ostbl->add(new BoxSTTS());
-        ostbl->add(new BoxSTSC());
-        ostbl->add(new BoxSTSZ());
-        ostbl->add(new BoxSTCO());
-
-        BoxSimpleList *omvex = new BoxSimpleList("mvex");
-        omoov->add(omvex);
-        omvex->add(new BoxTREX());
+    if (opt.single) {
+        char fname[256];
+        sprintf(fname, "dash/stream%d.mp4", track_idx);
+        int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || !write_single_file(fd, track, samples, file, segments, rep,
+                                         opt.segments_per_index, (uint64_t)opt.chunk_ms * timeScale / 1000)) {
+            log << "can't write " << fname << endl;
+        }
+        if (fd >= 0) close(fd);
+        rep.base_url = fname + 5; // relative to the mpd
+        log << "output:" << fname << " segments:" << rep.segments.size() << endl;
+        log << "bandwidth: " << rep.peakBandwidth() << " (average " << rep.averageBandwidth() << ")" << endl;
+        return 0;
+    }
 
+    // write init
+    {
         char fname[256];
         sprintf(fname, "dash/init-stream%d.m4s", track_idx);
-        m4s.write(ofstream(fname, ios::binary));
+        ofstream ofs(fname, ios::binary);
+        write_init_segment(ofs, track);
     }
 
-    // write segments
-    uint32_t seg_duration = 5 * reader.timeScale();
-    uint64_t last_timestamp = 0;
-    for(int frag = 1; !reader.eos(); frag++) {
-
-        Mp4Root m4s;
-        m4s.clear();
-        auto oftyp = new BoxSTYP(0);
-        m4s.add(oftyp);
-        memcpy(oftyp->major, "msdh", 4);
-        oftyp->minor = 0;
-        oftyp->compat.push_back(0x6864736d); // msdh
-        oftyp->compat.push_back(0x7869736d); // msix
-
-        auto osidx = new BoxSIDX();
-        m4s.add(osidx);
-        osidx->time_scale = timeScale;
-        osidx->pts = last_timestamp * timeScale / reader.timeScale();
-
-        auto moof = new BoxSimpleList(BOX_MOOF);
-        m4s.add(moof);
-
-        auto mfhd = new BoxMFHD();
-        mfhd->fragments = frag;
-        moof->add(mfhd);
-
-        auto traf = new BoxSimpleList(BOX_TRAF);
-        moof->add(traf);
-
-        auto tfhd = new BoxTFHD();
-        tfhd->flags |= BoxTFHD::FLAG_DEFAULT_SIZE | BoxTFHD::FLAG_DEFAULT_FLAGS; // ffmpeg compat
-        tfhd->default_size = 0;
-        tfhd->default_flags = SAMPLE_FLAGS_NO_SYNC;
-        traf->add(tfhd);
-
-        auto tfdt = new BoxTFDT();
-        tfdt->flag_start = osidx->pts;
-        traf->add(tfdt);
-
-        auto trun = new BoxTRUN();
-        trun->flags = BoxTRUN::FLAG_SAMPLE_SIZE | BoxTRUN::FLAG_SAMPLE_FLAGS
-            | BoxTRUN::FLAG_SAMPLE_CTS | BoxTRUN::FLAG_DATA_OFFSET;
-        traf->add(trun);
-
-        auto mdat = new UnknownBox(BOX_MDAT, 8); // TODO
-        m4s.add(mdat);
-
-        int64_t start_timestamp = -1;
-        uint32_t samples = 0;
-        while (!reader.eos()) {
-            Sample sample = reader.read(ifs);
-            if (false) {
-                cout << "  size: " << sample.data.size() << endl;
-                cout << "  timestamp: " << sample.timestamp << endl;
-                if (sample.has_time_offset) {
-                    cout << "  time offset: " << sample.time_offset << endl;
-                }
-            }
-
-            trun->add(sample.data.size());
-            trun->add(sample.sync_point ? SAMPLE_FLAGS_SYNC : SAMPLE_FLAGS_NO_SYNC );
-            trun->add(sample.time_offset * timeScale / sample.time_scale);
-            mdat->buf.insert(mdat->buf.end(), sample.data.begin(), sample.data.end());
-
-            if (start_timestamp < 0) start_timestamp = sample.timestamp;
-            last_timestamp = sample.timestamp;
-            samples++;
-            if (samples > 1 && sample.timestamp > seg_duration * frag && reader.syncPoint()) break;
+    // write segments. moof is built from the index, samples are copied from the source file.
+    MediaSegmentWriter writer(samples, file);
+    if (opt.chunk_ms > 0) {
+        // chunks are sent before the segment is complete, no sidx in front of them.
+        writer.chunk_duration = (uint64_t)opt.chunk_ms * timeScale / 1000;
+        writer.segment_index = false;
+    }
+    rep.initialization = "init-stream" + to_string(track_idx) + ".m4s";
+    rep.media = "chunk-stream" + to_string(track_idx) + "-$Number%05d$.m4s";
+    uint32_t seq = 1;
+    for (size_t i = 0; i + 1 < segments.size(); i++) {
+        int frag = i + 1;
+        if (!writer.build(segments[i], segments[i + 1], seq)) {
+            log << "segment " << frag << " is too large for sidx" << endl;
+            return 1;
         }
-        last_timestamp += (last_timestamp - start_timestamp) / (samples - 1);
-        tfhd->default_duration = (last_timestamp - start_timestamp) / (samples - 1);
-
-        moof->calcSize();
-        osidx->add(moof->size + mdat->calcSize(), last_timestamp, 1<<31); // (1<<31) = start with SAP
-        trun->data_offset = moof->size + 8; // pos(mdat.data) - pos(moof)
+        seq += writer.chunkCount();
 
         char fname[256];
-        sprintf(fname, "dash/chunk-stream%d-%05d.m4s", track_idx, frag);;
-        m4s.write(ofstream(fname, ios::binary));
-        cout << "output:" << fname  <<  " t:" << last_timestamp << endl;
+        sprintf(fname, "dash/chunk-stream%d-%05d.m4s", track_idx, frag);
+        int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || !writer.write(fd)) {
+            log << "can't write " << fname << endl;
+        }
+        if (fd >= 0) close(fd);
+        log << "output:" << fname  <<  " t:" << writer.endTime() << endl;
+        rep.add(writer.startTime(), writer.endTime() - writer.startTime(), writer.size());
     }
+    log << "bandwidth: " << rep.peakBandwidth() << " (average " << rep.averageBandwidth() << ")" << endl;
 
     return 0;
 }
 
 
-int main() {
-
-    ifstream ifs("test2.mp4", ios::binary); // AVC+AAC mp4
+// usage: mp4dash [-j threads] [-c chunk_ms] [-s [-i segments_per_index]]
+// -s: a file per track with sidx (on-demand profile). -i: hierarchical sidx.
+int main(int argc, char *argv[]) {
+    int jobs = 1;
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        if (a == "-s") opt.single = true;
+        else if (i + 1 >= argc) break;
+        else if (a == "-j") jobs = max(1, atoi(argv[++i]));
+        else if (a == "-c") opt.chunk_ms = max(0, atoi(argv[++i]));
+        else if (a == "-i") opt.segments_per_index = max(0, atoi(argv[++i]));
+    }
 
     Mp4Root mp4;
-    mp4.parse(ifs);
+    if (!mp4.parseMapped("test2.mp4")) { // AVC+AAC mp4
+        cerr << "can't open test2.mp4" << endl;
+        return 1;
+    }
     cout << mp4;
 
     // get tracks
-    vector<Box*> tracks;
-    mp4.findAllByType(tracks, BOX_TRAK);
+    const BoxIndex &index = mp4.buildIndex();
+    const vector<Box*> &tracks = index.all(BOX_TRAK);
+
+    // tracks are independent. sample data is copied from the mapped file's fd,
+    // logs are printed in track order.
+    vector<ostringstream> logs(tracks.size());
+    vector<DashRepresentation> reps(tracks.size());
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < tracks.size();) {
+            convert(*mp4.mappedFile(), index, tracks[i], i, opt, reps[i], logs[i]); // track_idx != track_id
+        }
+    };
+    vector<thread> pool;
+    for (int i = 1; i < jobs && i < (int)tracks.size(); i++) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
 
-    int track_idx = 0; // != track_id
-    for (auto track : tracks) {
-        convert(ifs, track, track_idx);
-        track_idx ++;
-    }
+    for (auto &log : logs) cout << log.str();
+
+    ofstream mpd("dash/test.mpd");
+    write_mpd(mpd, reps);
+    cout << "output:dash/test.mpd" << endl;
 
     return 0;
 }
@@ -0,0 +1,792 @@
+// MPEG-DASH segmenter (fragmented mp4)
+
+#ifndef MP4DASH_H_
+#define MP4DASH_H_
+
+#include "isobmff.h"
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
+#include <list>
+#include <mutex>
+
+namespace isobmff {
+
+// segment boundaries of a track. a segment ends after duration * n (in track time scale)
+// at a sample followed by a sync sample.
+// returns the first sample of each segment and count() at the end.
+static inline std::vector<uint32_t> plan_segments(const SampleIndex &index, uint64_t duration) {
+    std::vector<uint32_t> first{0};
+    uint32_t n = index.count();
+    uint64_t limit = duration;
+    for (uint32_t s = 1; s + 1 < n; s++) {
+        if (s > first.back() && index.dts[s] > limit && index.sync[s + 1]) {
+            first.push_back(s + 1);
+            limit += duration;
+            s++; // a segment has 2 samples at least.
+        }
+    }
+    if (n > 0) first.push_back(n);
+    return first;
+}
+
+// init segment (ftyp, moov with empty sample tables and mvex) of tracks. track ids are 1, 2, ... in order.
+static inline bool write_init_segment(std::ostream &os, const std::vector<Box*> &tracks) {
+    if (tracks.empty()) return false;
+    Mp4Root m4s;
+    BoxFTYP *oftyp = m4s.adopt(new BoxFTYP(0));
+    memcpy(oftyp->major, "iso5", 4);
+    oftyp->minor = 512;
+    oftyp->compat.push_back(0x366f7369); // iso6
+    oftyp->compat.push_back(0x3134706d); // mp41
+
+    BoxSimpleList *omoov = m4s.adopt(new BoxSimpleList(BOX_MOOV));
+
+    BoxMVHD *omvhd = omoov->adopt(new BoxMVHD());
+    omvhd->init();
+    omvhd->duration = 0;
+    omvhd->next_track_id = std::max<uint32_t>(omvhd->next_track_id, tracks.size() + 1);
+
+    BoxSimpleList *omvex = new BoxSimpleList(BOX_MVEX);
+    for (size_t i = 0; i < tracks.size(); i++) {
+        Box *track = tracks[i];
+        auto tkhd = track->find<BoxTKHD>("tkhd");
+        auto mdhd = track->find<BoxMDHD>("mdia/mdhd");
+        auto hdlr = track->find<BoxHDLR>("mdia/hdlr");
+        auto stsd = track->find<BoxSTSD>("mdia/minf/stbl/stsd");
+        Box *ohdlr = hdlr != nullptr ? copy_box(hdlr) : nullptr;
+        Box *ostsd = stsd != nullptr ? copy_box(stsd) : nullptr;
+        if (tkhd == nullptr || mdhd == nullptr || ohdlr == nullptr || ostsd == nullptr) {
+            delete ohdlr;
+            delete ostsd;
+            delete omvex;
+            return false;
+        }
+        uint32_t timeScale = mdhd->time_scale;
+        if (i == 0) omvhd->timeScale = timeScale;
+
+        BoxSimpleList *otrack = omoov->adopt(new BoxSimpleList(BOX_TRAK));
+        BoxTKHD *otkhd = otrack->adopt(new BoxTKHD());
+        otkhd->init();
+        otkhd->track_id = i + 1;
+        otkhd->volume = tkhd->volume;
+        otkhd->width = tkhd->width;
+        otkhd->height = tkhd->height;
+        // otrack->add(track->findByType("edts")); // TODO
+
+        BoxSimpleList *omdia = otrack->adopt(new BoxSimpleList(BOX_MDIA));
+        BoxMDHD *omdhd = omdia->adopt(new BoxMDHD());
+        omdhd->time_scale = timeScale;
+        omdia->adopt(ohdlr);
+
+        BoxSimpleList *ominf = omdia->adopt(new BoxSimpleList(BOX_MINF));
+        //if (track->findByType("vmhd") != nullptr) {
+        //    ominf->add(track->findByType("vmhd"));
+        //}
+        //ominf->add(track->findByType("dinf"));
+
+        auto ostbl = ominf->adopt(new BoxSimpleList(BOX_STBL));
+
+        ostbl->adopt(ostsd);
+
+        ostbl->adopt(new BoxSTTS());
+        ostbl->adopt(new BoxSTSC());
+        ostbl->adopt(new BoxSTSZ());
+        ostbl->adopt(new BoxSTCO());
+
+        auto trex = omvex->adopt(new BoxTREX());
+        trex->track_id = i + 1;
+    }
+    omoov->adopt(omvex);
+
+    m4s.write(os);
+    return os.good();
+}
+
+static inline bool write_init_segment(std::ostream &os, Box *track) {
+    return write_init_segment(os, std::vector<Box*>{track});
+}
+
+// write all iovecs. IOV_MAX at a time, retried on short writes and EINTR. iov is modified.
+static inline bool writev_fd(int fd, struct iovec *iov, size_t n) {
+    while (n > 0) {
+        if (iov->iov_len == 0) { // a write of 0 bytes is no progress below.
+            iov++;
+            n--;
+            continue;
+        }
+        ssize_t w = ::writev(fd, iov, std::min<size_t>(n, IOV_MAX));
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        for (; n > 0 && (size_t)w >= iov->iov_len; iov++, n--) w -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return true;
+}
+
+// media segment (styp, sidx, moof, mdat) of samples [first, last) of a track.
+// boxes and mdat headers are built from the sample index up front,
+// sample data goes from the source file to the output without a user space buffer.
+// with chunk_duration, the segment is a series of CMAF chunks (moof + mdat) for low latency delivery.
+class MediaSegmentWriter {
+public:
+    struct Range {
+        uint64_t offset; // in source
+        uint64_t size;
+    };
+    // moof + mdat. the first one starts with styp and sidx (if any).
+    struct Chunk {
+        std::string head; // boxes and the mdat header.
+        size_t range_begin, range_end; // dataRanges()
+        uint32_t first, last; // samples
+        uint64_t size;
+    };
+
+    uint32_t track_id;
+    uint64_t chunk_duration; // in track time scale. 0: a moof per segment.
+    bool segment_index; // sidx. a reference per chunk.
+    bool segment_type; // styp. off for subsegments in a single file.
+
+    MediaSegmentWriter(const SampleIndex &index, const MappedFile &source)
+        : track_id(1), chunk_duration(0), segment_index(true), segment_type(true), index(index), source(source), start(0), end(0) {}
+
+    // build boxes. seq: sequence number (mfhd) of the first moof, from 1. chunks get seq, seq + 1, ...
+    // false (and no chunks) if a chunk doesn't fit in a sidx reference.
+    bool build(uint32_t first, uint32_t last, uint32_t seq) {
+        last = std::min<uint32_t>(last, index.count());
+        first = std::min(first, last);
+        chunks.clear();
+        ranges.clear();
+
+        // chunk boundaries. a chunk needn't start with a sync sample.
+        std::vector<uint32_t> cut{first};
+        for (uint32_t s = first + 1; chunk_duration > 0 && s < last; s++) {
+            if (index.dts[s] - index.dts[cut.back()] >= chunk_duration) cut.push_back(s);
+        }
+        cut.push_back(last);
+
+        start = first < last ? index.dts[first] : 0;
+        end = start;
+        std::vector<uint64_t> durations;
+        for (size_t c = 0; c + 1 < cut.size(); c++) {
+            durations.push_back(buildChunk(cut[c], cut[c + 1], seq + c));
+            end += durations.back();
+        }
+        for (size_t c = 0; segment_index && c < chunks.size(); c++) {
+            if (chunks[c].size > 0x7fffffff || durations[c] > UINT32_MAX) { // referenced_size: 31 bits.
+                chunks.clear();
+                ranges.clear();
+                return false;
+            }
+        }
+
+        Mp4Root m4s;
+        if (segment_type) {
+            auto ostyp = m4s.adopt(new BoxSTYP(0));
+            memcpy(ostyp->major, "msdh", 4);
+            ostyp->minor = 0;
+            ostyp->compat.push_back(0x6864736d); // msdh
+            if (segment_index) ostyp->compat.push_back(0x7869736d); // msix
+        }
+        if (segment_index) {
+            auto osidx = m4s.adopt(new BoxSIDX());
+            osidx->track_id = track_id;
+            osidx->time_scale = index.time_scale;
+            osidx->pts = start;
+            for (size_t c = 0; c < chunks.size(); c++) {
+                bool sap = index.sync[chunks[c].first];
+                osidx->add(chunks[c].size, durations[c], sap ? 1<<31 : 0); // (1<<31) = start with SAP
+            }
+        }
+        if (!chunks.empty()) {
+            std::ostringstream os;
+            m4s.write(os);
+            std::string prefix = os.str();
+            chunks[0].head.insert(0, prefix);
+            chunks[0].size += prefix.size();
+        }
+        return true;
+    }
+
+    size_t chunkCount() const {return chunks.size();}
+    const Chunk &chunk(size_t i) const {return chunks[i];}
+    // sample data in source.
+    const std::vector<Range> &dataRanges() const {return ranges;}
+    uint64_t size() const {
+        uint64_t n = 0;
+        for (auto &c : chunks) n += c.size;
+        return n;
+    }
+    uint64_t startTime() const {return start;}
+    uint64_t endTime() const {return end;}
+
+    // chunk i to out_fd. sample data is copied in kernel (copy_fd_range).
+    bool writeChunk(int out_fd, size_t i) const {
+        const Chunk &c = chunks[i];
+        if (!write_fd(out_fd, c.head.data(), c.head.size())) return false;
+        for (size_t r = c.range_begin; r < c.range_end; r++) {
+            if (!copy_fd_range(out_fd, source.handle(), ranges[r].offset, ranges[r].size)) return false;
+        }
+        return true;
+    }
+
+    // segment to out_fd, a chunk at a time.
+    bool write(int out_fd) const {
+        for (size_t i = 0; i < chunks.size(); i++) {
+            if (!writeChunk(out_fd, i)) return false;
+        }
+        return true;
+    }
+
+    // chunk i as iovecs (appended). sample data points into the mapping.
+    void chunkIovecs(size_t i, std::vector<struct iovec> &iov) const {
+        const Chunk &c = chunks[i];
+        iov.push_back({(void*)c.head.data(), c.head.size()});
+        for (size_t r = c.range_begin; r < c.range_end; r++) {
+            iov.push_back({(void*)(source.data() + ranges[r].offset), (size_t)ranges[r].size});
+        }
+    }
+
+    // segment as iovecs.
+    void iovecs(std::vector<struct iovec> &iov) const {
+        iov.clear();
+        iov.reserve(ranges.size() + chunks.size());
+        for (size_t i = 0; i < chunks.size(); i++) chunkIovecs(i, iov);
+    }
+
+    // segment to out_fd with writev from the mapping.
+    bool writev(int out_fd) const {
+        std::vector<struct iovec> iov;
+        iovecs(iov);
+        return writev_fd(out_fd, iov.data(), iov.size());
+    }
+
+private:
+    const SampleIndex &index;
+    const MappedFile &source;
+    std::vector<Chunk> chunks;
+    std::vector<Range> ranges;
+    uint64_t start;
+    uint64_t end;
+
+    // moof + mdat header of samples [first, last). returns the duration.
+    uint64_t buildChunk(uint32_t first, uint32_t last, uint32_t seq) {
+        uint32_t samples = last - first;
+
+        // default duration: average in the chunk. (the last one may have a single sample)
+        uint32_t duration = 0;
+        if (samples > 1) {
+            duration = (index.dts[last - 1] - index.dts[first]) / (samples - 1);
+        } else if (last < index.count()) {
+            duration = index.dts[last] - index.dts[first];
+        }
+        // per sample durations if they vary. (the last sample of the track has the default)
+        bool varies = false;
+        for (uint32_t s = first; s + 1 < last; s++) {
+            if (index.dts[s + 1] - index.dts[s] != duration) varies = true;
+        }
+        if (last < index.count() && index.dts[last] - index.dts[last - 1] != duration) varies = true;
+
+        Chunk c;
+        c.first = first;
+        c.last = last;
+        c.range_begin = ranges.size();
+        uint64_t data_size = 0;
+        for (uint32_t s = first; s < last; s++) { // coalesce contiguous samples.
+            if (ranges.size() > c.range_begin && ranges.back().offset + ranges.back().size == index.offset[s]) {
+                ranges.back().size += index.size[s];
+            } else {
+                ranges.push_back({index.offset[s], index.size[s]});
+            }
+            data_size += index.size[s];
+        }
+        c.range_end = ranges.size();
+
+        BoxSimpleList moof(BOX_MOOF);
+
+        auto mfhd = moof.adopt(new BoxMFHD());
+        mfhd->fragments = seq;
+
+        auto traf = moof.adopt(new BoxSimpleList(BOX_TRAF));
+
+        auto tfhd = traf->adopt(new BoxTFHD());
+        tfhd->flags |= BoxTFHD::FLAG_DEFAULT_SIZE | BoxTFHD::FLAG_DEFAULT_FLAGS; // ffmpeg compat
+        tfhd->track_id = track_id;
+        tfhd->default_duration = duration;
+        tfhd->default_size = 0;
+        tfhd->default_flags = SAMPLE_FLAGS_NO_SYNC;
+
+        auto tfdt = traf->adopt(new BoxTFDT());
+        tfdt->flag_start = samples > 0 ? index.dts[first] : 0;
+
+        auto trun = traf->adopt(new BoxTRUN());
+        trun->flags = BoxTRUN::FLAG_SAMPLE_SIZE | BoxTRUN::FLAG_SAMPLE_FLAGS
+            | BoxTRUN::FLAG_SAMPLE_CTS | BoxTRUN::FLAG_DATA_OFFSET;
+        if (varies) trun->flags |= BoxTRUN::FLAG_SAMPLE_DURATION;
+        trun->data.reserve(samples * (varies ? 4 : 3));
+        uint64_t total = 0;
+        for (uint32_t s = first; s < last; s++) {
+            uint32_t d = s + 1 < index.count() ? index.dts[s + 1] - index.dts[s] : duration;
+            total += d;
+            if (varies) trun->add(d);
+            trun->add(index.size[s]);
+            trun->add(index.sync[s] ? SAMPLE_FLAGS_SYNC : SAMPLE_FLAGS_NO_SYNC);
+            trun->add(index.ctsOffset(s));
+        }
+
+        // mdat header only. the payload follows in write().
+        uint8_t h[16];
+        ByteWriter mdat(h, sizeof(h));
+        if (data_size + 8 > UINT32_MAX) {
+            mdat.u32(1);
+            mdat.u32(BOX_MDAT);
+            mdat.u64(data_size + 16);
+        } else {
+            mdat.u32(data_size + 8);
+            mdat.u32(BOX_MDAT);
+        }
+
+        moof.calcSize();
+        trun->data_offset = moof.size + mdat.size(); // pos(mdat.data) - pos(moof)
+
+        std::ostringstream os;
+        moof.write(os);
+        os.write((const char*)mdat.data(), mdat.size());
+        c.head = os.str();
+        c.size = c.head.size() + data_size;
+        chunks.push_back(std::move(c));
+        return total;
+    }
+};
+
+// segments of a track for the MPD.
+struct DashRepresentation {
+    struct Segment {
+        uint64_t start; // in time_scale
+        uint64_t duration;
+        uint64_t size; // bytes
+    };
+
+    std::string id;
+    std::string codecs;
+    bool audio;
+    uint32_t width, height; // tkhd
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t time_scale;
+    std::string initialization;
+    std::string media; // template. $Number$
+    std::vector<Segment> segments;
+    // single file (on-demand profile). SegmentBase byte ranges, inclusive.
+    std::string base_url;
+    uint64_t init_end;
+    uint64_t index_begin, index_end;
+
+    DashRepresentation() : audio(false), width(0), height(0), sample_rate(0), channels(0), time_scale(1),
+        init_end(0), index_begin(0), index_end(0) {}
+    // codecs and resolution from tkhd/stsd.
+    explicit DashRepresentation(Box *track) : DashRepresentation() {
+        auto tkhd = track->find<BoxTKHD>("tkhd");
+        auto mdhd = track->find<BoxMDHD>("mdia/mdhd");
+        auto stsd = track->find<BoxSTSD>("mdia/minf/stbl/stsd");
+        if (mdhd != nullptr) time_scale = mdhd->time_scale;
+        if (stsd != nullptr) {
+            codecs = stsd->codecString();
+            audio = stsd->isAudio();
+            sample_rate = stsd->sampleRate();
+            channels = stsd->channels();
+        }
+        if (tkhd != nullptr && !audio) {
+            width = tkhd->width >> 16;
+            height = tkhd->height >> 16;
+        }
+    }
+
+    void add(uint64_t start, uint64_t duration, uint64_t size) {
+        segments.push_back({start, duration, size});
+    }
+    uint64_t duration() const {
+        return segments.empty() ? 0 : segments.back().start + segments.back().duration - segments.front().start;
+    }
+    uint64_t maxSegmentDuration() const {
+        uint64_t d = 0;
+        for (auto &s : segments) d = std::max(d, s.duration);
+        return d;
+    }
+    // bits per second of the largest segment.
+    // with minBufferTime >= maxSegmentDuration, this keeps the buffer from running dry. (MPD @bandwidth)
+    uint64_t peakBandwidth() const {
+        uint64_t b = 0;
+        for (auto &s : segments) {
+            if (s.duration > 0) b = std::max<uint64_t>(b, (s.size * 8 * time_scale + s.duration - 1) / s.duration);
+        }
+        return b;
+    }
+    uint64_t averageBandwidth() const {
+        uint64_t bytes = 0;
+        for (auto &s : segments) bytes += s.size;
+        uint64_t d = duration();
+        return d > 0 ? bytes * 8 * time_scale / d : 0;
+    }
+};
+
+// xs:duration. PT12.34S
+static inline std::string mpd_duration(uint64_t t, uint32_t time_scale) {
+    char s[64];
+    snprintf(s, sizeof(s), "PT%llu.%03lluS", (unsigned long long)(t / time_scale),
+             (unsigned long long)(t % time_scale * 1000 / time_scale));
+    return s;
+}
+
+// SegmentTemplate with an exact SegmentTimeline.
+static inline void write_segment_template(std::ostream &os, const DashRepresentation &r) {
+    os << "      <SegmentTemplate timescale=\"" << r.time_scale << "\" initialization=\"" << r.initialization
+       << "\" media=\"" << r.media << "\" startNumber=\"1\">\n";
+    os << "        <SegmentTimeline>\n";
+    uint64_t t = 0;
+    for (size_t i = 0; i < r.segments.size();) {
+        size_t n = 1; // S@r: repeats of the same duration.
+        while (i + n < r.segments.size() && r.segments[i + n].duration == r.segments[i].duration
+                && r.segments[i + n].start == r.segments[i].start + n * r.segments[i].duration) n++;
+        os << "          <S";
+        if (i == 0 || r.segments[i].start != t) os << " t=\"" << r.segments[i].start << "\""; // S@t: gaps only.
+        os << " d=\"" << r.segments[i].duration << "\"";
+        if (n > 1) os << " r=\"" << n - 1 << "\"";
+        os << "/>\n";
+        t = r.segments[i].start + n * r.segments[i].duration;
+        i += n;
+    }
+    os << "        </SegmentTimeline>\n";
+    os << "      </SegmentTemplate>\n";
+}
+
+// static MPD, an AdaptationSet per representation.
+// isoff-live with exact SegmentTimelines, or isoff-on-demand (SegmentBase) if representations have base_url.
+static inline void write_mpd(std::ostream &os, const std::vector<DashRepresentation> &reps) {
+    uint64_t duration_ms = 0, max_segment_ms = 0;
+    bool on_demand = !reps.empty();
+    for (auto &r : reps) {
+        on_demand = on_demand && !r.base_url.empty();
+        duration_ms = std::max(duration_ms, r.duration() * 1000 / r.time_scale);
+        max_segment_ms = std::max(max_segment_ms, (r.maxSegmentDuration() * 1000 + r.time_scale - 1) / r.time_scale);
+    }
+    os << "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
+    os << "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:"
+       << (on_demand ? "isoff-on-demand" : "isoff-live") << ":2011\" type=\"static\"\n";
+    os << "    mediaPresentationDuration=\"" << mpd_duration(duration_ms, 1000) << "\"";
+    os << " maxSegmentDuration=\"" << mpd_duration(max_segment_ms, 1000) << "\"";
+    os << " minBufferTime=\"" << mpd_duration(max_segment_ms, 1000) << "\">\n";
+    os << "  <Period id=\"p1\" start=\"PT0S\">\n";
+    for (auto &r : reps) {
+        const char *type = r.audio ? "audio" : "video";
+        os << "    <AdaptationSet mimeType=\"" << type << "/mp4\" contentType=\"" << type
+           << "\" segmentAlignment=\"true\" " << (on_demand ? "subsegmentAlignment=\"true\" subsegmentStartsWithSAP" : "startWithSAP")
+           << "=\"1\">\n";
+        if (!on_demand) write_segment_template(os, r);
+        os << "      <Representation id=\"" << r.id << "\" bandwidth=\"" << r.peakBandwidth() << "\" codecs=\"" << r.codecs << "\"";
+        if (r.audio && r.sample_rate > 0) os << " audioSamplingRate=\"" << r.sample_rate << "\"";
+        if (!r.audio && r.width > 0) os << " width=\"" << r.width << "\" height=\"" << r.height << "\"";
+        if ((!r.audio || r.channels == 0) && !on_demand) {
+            os << "/>\n";
+        } else {
+            os << ">\n";
+            if (r.audio && r.channels > 0) {
+                os << "        <AudioChannelConfiguration schemeIdUri=\"urn:mpeg:dash:23003:3:audio_channel_configuration:2011\" value=\""
+                   << r.channels << "\"/>\n";
+            }
+            if (on_demand) {
+                os << "        <BaseURL>" << r.base_url << "</BaseURL>\n";
+                os << "        <SegmentBase timescale=\"" << r.time_scale << "\" indexRange=\"" << r.index_begin << "-" << r.index_end << "\">\n";
+                os << "          <Initialization range=\"0-" << r.init_end << "\"/>\n";
+                os << "        </SegmentBase>\n";
+            }
+            os << "      </Representation>\n";
+        }
+        os << "    </AdaptationSet>\n";
+    }
+    os << "  </Period>\n";
+    os << "</MPD>\n";
+}
+
+// single file (on-demand profile): init segment, sidx, moof + mdat of every segment, then mfra.
+// segments_per_index > 0: hierarchical sidx, the top sidx refers to a sidx per segments_per_index segments.
+// rep gets the segments and SegmentBase ranges. out_fd must be at the start of the file.
+static inline bool write_single_file(int out_fd, Box *track, const SampleIndex &index, const MappedFile &source,
+                                     const std::vector<uint32_t> &plan, DashRepresentation &rep,
+                                     uint32_t segments_per_index = 0, uint64_t chunk_duration = 0) {
+    std::ostringstream init;
+    if (!write_init_segment(init, track)) return false;
+
+    // subsegments are measured first, the sidx goes in front of them.
+    MediaSegmentWriter writer(index, source);
+    writer.segment_type = false;
+    writer.segment_index = false;
+    writer.chunk_duration = chunk_duration;
+    std::vector<uint32_t> seq{1}; // first mfhd sequence number of each segment.
+    rep.segments.clear();
+    for (size_t i = 0; i + 1 < plan.size(); i++) {
+        if (!writer.build(plan[i], plan[i + 1], seq.back())) return false;
+        seq.push_back(seq.back() + writer.chunkCount());
+        rep.add(writer.startTime(), writer.endTime() - writer.startTime(), writer.size());
+        if (writer.size() > 0x7fffffff) return false; // referenced_size: 31 bits.
+    }
+    const auto &subs = rep.segments;
+
+    auto sidx = [&](uint64_t pts) {
+        auto b = new BoxSIDX();
+        b->track_id = writer.track_id;
+        b->time_scale = index.time_scale;
+        b->pts = pts;
+        return b;
+    };
+    auto sap = [&](size_t i) {return index.sync[plan[i]] ? 1u << 31 : 0u;}; // start with SAP
+
+    Mp4Root top;
+    BoxSIDX *tsidx = top.adopt(sidx(subs.empty() ? 0 : subs[0].start));
+    std::vector<std::string> children; // sidx of each group.
+    size_t group = segments_per_index > 0 ? segments_per_index : std::max<size_t>(subs.size(), 1);
+    for (size_t g = 0; g < subs.size(); g += group) {
+        size_t e = std::min(g + group, subs.size());
+        if (segments_per_index == 0) {
+            for (size_t i = g; i < e; i++) tsidx->add(subs[i].size, subs[i].duration, sap(i));
+            continue;
+        }
+        Mp4Root c;
+        BoxSIDX *csidx = c.adopt(sidx(subs[g].start));
+        uint64_t size = 0, duration = 0;
+        for (size_t i = g; i < e; i++) {
+            csidx->add(subs[i].size, subs[i].duration, sap(i));
+            size += subs[i].size;
+            duration += subs[i].duration;
+        }
+        std::ostringstream os;
+        c.write(os);
+        children.push_back(os.str());
+        size += children.back().size();
+        if (size > 0x7fffffff || duration > UINT32_MAX) return false;
+        tsidx->add(size | 1u << 31, duration, sap(g)); // reference_type 1: sidx
+    }
+    std::ostringstream index_box;
+    top.write(index_box);
+
+    std::string head = init.str();
+    rep.init_end = head.size() - 1;
+    rep.index_begin = head.size();
+    head += index_box.str();
+    rep.index_end = head.size() - 1;
+    if (!write_fd(out_fd, head.data(), head.size())) return false;
+
+    // mfra: the moof of each segment that starts with a sync sample.
+    auto tfra = new BoxTFRA();
+    tfra->track_id = writer.track_id;
+    uint64_t pos = head.size();
+    for (size_t i = 0; i < subs.size(); i++) {
+        if (segments_per_index > 0 && i % group == 0) {
+            const std::string &c = children[i / group];
+            if (!write_fd(out_fd, c.data(), c.size())) return false;
+            pos += c.size();
+        }
+        if (index.sync[plan[i]]) tfra->add(index.dts[plan[i]] + index.ctsOffset(plan[i]), pos); // presentation time
+        if (!writer.build(plan[i], plan[i + 1], seq[i]) || !writer.write(out_fd)) return false;
+        pos += subs[i].size;
+    }
+    std::ostringstream mfra;
+    write_mfra(mfra, {tfra});
+    std::string tail = mfra.str();
+    return write_fd(out_fd, tail.data(), tail.size());
+}
+
+// packaged segment. headers own their bytes, sample data points into the source mapping.
+struct DashSegment {
+    std::vector<std::string> heads;
+    std::vector<struct iovec> iov;
+    uint64_t size;
+
+    DashSegment() : size(0) {}
+    DashSegment(const DashSegment&) = delete;
+    DashSegment& operator=(const DashSegment&) = delete;
+
+    // contiguous copy.
+    std::string bytes() const {
+        std::string s;
+        s.reserve(size);
+        for (auto &v : iov) s.append((const char*)v.iov_base, v.iov_len);
+        return s;
+    }
+    bool write(int fd) const {
+        std::vector<struct iovec> v(iov);
+        return writev_fd(fd, v.data(), v.size());
+    }
+    // memory held by the segment. (cache cost)
+    size_t footprint() const {
+        size_t n = sizeof(*this) + iov.size() * sizeof(struct iovec);
+        for (auto &h : heads) n += h.size();
+        return n;
+    }
+};
+
+// just in time packager. segment plans are built once at open(),
+// init and media segments are built on request and kept in an LRU cache.
+// thread safe after open().
+class DashPackager {
+public:
+    struct Options {
+        uint32_t segment_ms;
+        uint32_t chunk_ms; // LL-CMAF chunks. 0: a moof per segment.
+        size_t cache_bytes; // LRU cache. headers only, sample data stays in the page cache.
+        Options() : segment_ms(5000), chunk_ms(0), cache_bytes(16 << 20) {}
+    };
+
+    DashPackager() : cached(0), hit_count(0), miss_count(0) {}
+    explicit DashPackager(const char *path, const Options &opt = Options()) : DashPackager() { open(path, opt); }
+    DashPackager(const DashPackager&) = delete;
+    DashPackager& operator=(const DashPackager&) = delete;
+
+    // segments from the previous file must not be in use.
+    bool open(const char *path, const Options &opt = Options()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        options = opt;
+        tracks.clear();
+        lru.clear();
+        entries.clear();
+        cached = 0;
+        mp4.clear();
+        if (!mp4.parseMapped(path)) return false;
+        Box *moov = mp4.find("moov");
+        if (moov == nullptr) return false;
+        for (Box *trak; (trak = moov->child(BOX_TRAK, tracks.size())) != nullptr;) {
+            tracks.emplace_back(new Track(trak));
+            Track &t = *tracks.back();
+            std::ostringstream init;
+            write_init_segment(init, trak);
+            t.init = init.str();
+
+            // plan. sizes are measured by building each segment once. (for the MPD)
+            uint32_t ts = t.index.time_scale;
+            t.plan = plan_segments(t.index, (uint64_t)opt.segment_ms * ts / 1000);
+            int n = tracks.size() - 1;
+            t.rep = DashRepresentation(trak);
+            t.rep.id = "stream" + std::to_string(n);
+            t.rep.initialization = "init-stream" + std::to_string(n) + ".m4s";
+            t.rep.media = "chunk-stream" + std::to_string(n) + "-$Number%05d$.m4s";
+            MediaSegmentWriter writer(t.index, *mp4.mappedFile());
+            setup(writer, ts);
+            uint32_t seq = 1;
+            for (size_t i = 0; i + 1 < t.plan.size(); i++) {
+                t.seq.push_back(seq);
+                if (!writer.build(t.plan[i], t.plan[i + 1], seq)) {
+                    tracks.clear();
+                    return false;
+                }
+                seq += writer.chunkCount();
+                t.rep.add(writer.startTime(), writer.endTime() - writer.startTime(), writer.size());
+            }
+        }
+        return true;
+    }
+
+    bool is_open() const {return !tracks.empty();}
+    size_t trackCount() const {return tracks.size();}
+    // segment numbers are 1..segmentCount(track).
+    uint32_t segmentCount(size_t track) const {return track < tracks.size() ? tracks[track]->seq.size() : 0;}
+    const DashRepresentation &representation(size_t track) const {return tracks[track]->rep;}
+
+    void mpd(std::ostream &os) const {
+        std::vector<DashRepresentation> reps;
+        for (auto &t : tracks) reps.push_back(t->rep);
+        write_mpd(os, reps);
+    }
+
+    // init segment. empty if no track.
+    const std::string &init(size_t track) const {
+        static const std::string empty;
+        return track < tracks.size() ? tracks[track]->init : empty;
+    }
+
+    // media segment, number from 1. nullptr if out of range.
+    std::shared_ptr<const DashSegment> segment(size_t track, uint32_t number) {
+        if (track >= tracks.size() || number < 1 || number > tracks[track]->seq.size()) return nullptr;
+        uint64_t key = (uint64_t)track << 32 | number;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto e = entries.find(key);
+            if (e != entries.end()) {
+                lru.splice(lru.begin(), lru, e->second);
+                hit_count++;
+                return e->second->second;
+            }
+            miss_count++;
+        }
+
+        // build outside the lock.
+        Track &t = *tracks[track];
+        MediaSegmentWriter writer(t.index, *mp4.mappedFile());
+        setup(writer, t.index.time_scale);
+        if (!writer.build(t.plan[number - 1], t.plan[number], t.seq[number - 1])) return nullptr;
+        auto seg = std::make_shared<DashSegment>();
+        for (size_t i = 0; i < writer.chunkCount(); i++) seg->heads.push_back(writer.chunk(i).head);
+        for (size_t i = 0; i < writer.chunkCount(); i++) {
+            const std::string &h = seg->heads[i];
+            seg->iov.push_back({(void*)h.data(), h.size()});
+            const auto &c = writer.chunk(i);
+            for (size_t r = c.range_begin; r < c.range_end; r++) {
+                const auto &range = writer.dataRanges()[r];
+                seg->iov.push_back({(void*)(mp4.mappedFile()->data() + range.offset), (size_t)range.size});
+            }
+        }
+        seg->size = writer.size();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto e = entries.find(key);
+        if (e != entries.end()) return e->second->second; // built by another thread meanwhile.
+        lru.emplace_front(key, seg);
+        entries[key] = lru.begin();
+        cached += seg->footprint();
+        while (cached > options.cache_bytes && lru.size() > 1) {
+            cached -= lru.back().second->footprint();
+            entries.erase(lru.back().first);
+            lru.pop_back();
+        }
+        return seg;
+    }
+
+    // cache stats.
+    size_t cacheBytes() const {std::lock_guard<std::mutex> lock(mutex); return cached;}
+    uint64_t hits() const {std::lock_guard<std::mutex> lock(mutex); return hit_count;}
+    uint64_t misses() const {std::lock_guard<std::mutex> lock(mutex); return miss_count;}
+
+private:
+    struct Track {
+        Box *trak;
+        SampleIndex index;
+        std::vector<uint32_t> plan; // plan_segments()
+        std::vector<uint32_t> seq; // first mfhd sequence number of each segment.
+        std::string init;
+        DashRepresentation rep;
+        explicit Track(Box *trak) : trak(trak), index(trak) {}
+    };
+    typedef std::list<std::pair<uint64_t, std::shared_ptr<const DashSegment>>> Lru;
+
+    Mp4Root mp4;
+    Options options;
+    std::vector<std::unique_ptr<Track>> tracks;
+    mutable std::mutex mutex;
+    Lru lru; // most recent first.
+    std::unordered_map<uint64_t, Lru::iterator> entries;
+    size_t cached;
+    uint64_t hit_count, miss_count;
+
+    void setup(MediaSegmentWriter &writer, uint32_t time_scale) const {
+        if (options.chunk_ms > 0) {
+            writer.chunk_duration = (uint64_t)options.chunk_ms * time_scale / 1000;
+            writer.segment_index = false;
+        }
+    }
+};
+
+} // namespace isobmff
+
+#endif
@@ -0,0 +1,198 @@
+#include "mp4dash.h"
+#include <iostream>
+#include <fstream>
+#include <cassert>
+#include <sstream>
+#include <thread>
+
+using namespace std;
+using namespace isobmff;
+
+// counts bytes in use, to find boxes that are not freed.
+class CountingResource : public std::pmr::memory_resource {
+public:
+    size_t used = 0;
+private:
+    void *do_allocate(size_t n, size_t align) {
+        used += n;
+        return std::pmr::new_delete_resource()->allocate(n, align);
+    }
+    void do_deallocate(void *p, size_t n, size_t align) {
+        used -= n;
+        std::pmr::new_delete_resource()->deallocate(p, n, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept {return this == &other;}
+};
+
+// segment boxes are freed with the segment.
+static void test_segment_boxes(Box *track, const SampleIndex &samples, const MappedFile &file) {
+    vector<uint32_t> plan = plan_segments(samples, samples.time_scale);
+    CountingResource counter;
+    {
+        BoxAllocScope scope(&counter);
+        MediaSegmentWriter writer(samples, file);
+        for (int i = 0; i < 10; i++) {
+            writer.chunk_duration = i % 2 ? samples.time_scale / 4 : 0;
+            for (size_t s = 0; s + 1 < plan.size(); s++) writer.build(plan[s], plan[s + 1], s + 1);
+        }
+        assert(writer.chunkCount() > 0);
+    }
+    assert(counter.used == 0);
+
+    {
+        BoxAllocScope scope(&counter);
+        for (uint32_t per_index : {0, 2}) {
+            DashRepresentation rep(track);
+            int fd = open("dash_test.mp4", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            assert(fd >= 0);
+            assert(write_single_file(fd, track, samples, file, plan, rep, per_index));
+            close(fd);
+        }
+    }
+    assert(counter.used == 0);
+}
+
+// init segment of a track without stsd fails and leaves nothing behind.
+static void test_init_segment(Box *track) {
+    CountingResource counter;
+    {
+        BoxAllocScope scope(&counter);
+        ostringstream os;
+        assert(write_init_segment(os, track));
+
+        Box *copy = copy_box(track);
+        Box *stbl = copy->find("mdia/minf/stbl");
+        for (size_t i = 0; i < stbl->children.size(); i++) {
+            if (stbl->children[i]->type != BOX_STSD) continue;
+            delete stbl->children[i];
+            stbl->children.erase(stbl->children.begin() + i);
+        }
+        ostringstream os2;
+        assert(!write_init_segment(os2, copy));
+        assert(os2.str().empty());
+        delete copy;
+    }
+    assert(counter.used == 0);
+}
+
+// a chunk over the 31-bit sidx referenced_size fails with sidx and builds without it.
+static void test_large_segment(const MappedFile &file) {
+    SampleIndex index;
+    for (uint32_t i = 0; i < 2; i++) {
+        index.offset.push_back(0);
+        index.size.push_back(0x50000000);
+        index.dts.push_back(i);
+        index.sync.push_back(1);
+    }
+    MediaSegmentWriter writer(index, file);
+    assert(!writer.build(0, 2, 1) && writer.chunkCount() == 0);
+    assert(writer.build(0, 1, 1));
+    writer.segment_index = false;
+    assert(writer.build(0, 2, 1) && writer.chunkCount() == 1);
+}
+
+// single file ends with mfra. a seek through tfra reads the samples from the segment on,
+// also without tfdt (the start time comes from tfra).
+static void test_random_access(Box *track, const SampleIndex &samples, const MappedFile &file) {
+    vector<uint32_t> plan = plan_segments(samples, samples.time_scale);
+    assert(plan.size() > 3);
+    DashRepresentation rep(track);
+    int fd = open("dash_test.mp4", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0 && write_single_file(fd, track, samples, file, plan, rep));
+    close(fd);
+    ifstream ifs("dash_test.mp4", ios::binary);
+    string data((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+
+    uint32_t first = plan[plan.size() / 2];
+    uint64_t t = samples.dts[first] + samples.ctsOffset(first);
+    for (bool tfdt : {true, false}) {
+        if (!tfdt) {
+            for (size_t p = 0; (p = data.find("tfdt", p)) != string::npos;) data.replace(p, 4, "free");
+        }
+        istringstream is(data);
+        FragmentRandomAccess ra;
+        assert(ra.load(is));
+        const BoxTFRA::Entry *e = ra.entry(0, t);
+        assert(e != nullptr && e->time == t);
+        assert(ra.entry(0, t + 1) == e && ra.entry(0, t - 1) != e);
+        assert(ra.moofOffset(0, t) == (int64_t)e->moof_offset);
+
+        SampleIndex index;
+        assert(index.buildFragmented(is, 0, nullptr, e));
+        assert(index.count() == samples.count() - first);
+        for (uint32_t i = 0; i < index.count(); i++) {
+            assert(index.dts[i] == samples.dts[first + i]);
+            assert(index.size[i] == samples.size[first + i]);
+            assert(index.sync[i] == samples.sync[first + i]);
+        }
+    }
+}
+
+static string read_file(const char *path) {
+    ifstream ifs(path, ios::binary);
+    return string((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+}
+
+// tracks packaged on threads sharing the source tree give the sequential output.
+// copy_box leaves the source box untouched.
+static void test_parallel_tracks(const vector<Box*> &tracks, const MappedFile &file) {
+    auto package = [&](Box *track, const char *path, string &init) {
+        SampleIndex samples(track);
+        vector<uint32_t> plan = plan_segments(samples, samples.time_scale);
+        DashRepresentation rep(track);
+        ostringstream os;
+        assert(write_init_segment(os, track));
+        init = os.str();
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0 && write_single_file(fd, track, samples, file, plan, rep));
+        close(fd);
+        return read_file(path);
+    };
+    vector<string> inits(tracks.size()), expected(tracks.size());
+    for (size_t i = 0; i < tracks.size(); i++) expected[i] = package(tracks[i], "dash_test.mp4", inits[i]);
+
+    Box *stsd = tracks[0]->find("mdia/minf/stbl/stsd");
+    int ref_count = stsd->ref_count;
+    size_t size = stsd->size;
+    const int jobs = 4 * tracks.size();
+    vector<string> out(jobs), init(jobs);
+    vector<thread> pool;
+    for (int j = 0; j < jobs; j++) {
+        pool.emplace_back([&, j]() {
+            string path = "dash_test_" + to_string(j) + ".mp4";
+            out[j] = package(tracks[j % tracks.size()], path.c_str(), init[j]);
+            unlink(path.c_str());
+        });
+    }
+    for (auto &t : pool) t.join();
+    for (int j = 0; j < jobs; j++) {
+        assert(out[j] == expected[j % tracks.size()] && init[j] == inits[j % tracks.size()]);
+    }
+    assert(stsd->ref_count == ref_count && stsd->size == size);
+
+    Box *copy = copy_box(stsd);
+    ostringstream a, b;
+    stsd->write(a);
+    copy->write(b);
+    assert(copy != stsd && copy->ref_count == 1 && a.str() == b.str());
+    delete copy;
+}
+
+int main() {
+    Mp4Root mp4;
+    assert(mp4.parseMapped("test.mp4"));
+    MappedFile file("test.mp4");
+    Box *track = mp4.findByType(BOX_TRAK);
+    assert(track != nullptr);
+    SampleIndex samples(track);
+    assert(samples.count() > 0);
+
+    test_init_segment(track);
+    test_segment_boxes(track, samples, file);
+    test_random_access(track, samples, file);
+    test_large_segment(file);
+    test_parallel_tracks(mp4.buildIndex().all(BOX_TRAK), file);
+
+    cout << "ok" << endl;
+    return 0;
+}
@@ -0,0 +1,24 @@
+#include "isobmff.h"
+#include <iostream>
+
+using namespace std;
+using namespace isobmff;
+
+// moov-at-end mp4 -> fast start mp4.
+// usage: mp4faststart [in.mp4] [out.mp4]
+int main(int argc, char *argv[]) {
+    const char *src = argc > 1 ? argv[1] : "test.mp4";
+    const char *dst = argc > 2 ? argv[2] : "out_faststart.mp4";
+
+    switch (faststart(src, dst)) {
+    case FASTSTART_DONE:
+        cout << "fast start: " << dst << endl;
+        return 0;
+    case FASTSTART_ALREADY:
+        cout << "already fast start: " << src << endl;
+        return 0;
+    default:
+        cerr << "failed: " << src << endl;
+        return 1;
+    }
+}
@@ -2,6 +2,7 @@
 #include "flv.h"
 #include <iostream>
 #include <fstream>
+#include <fcntl.h>
 
 using namespace std;
 using namespace isobmff;
@@ -14,46 +15,35 @@ int main() {
     mp4.parse(ifs);
     cout << mp4;
 
-    // get tracks
-    vector<Box*> tracks;
-    mp4.findAllByType(tracks, BOX_TRAK);
-
     // first track.  maybe video.
-    auto track = tracks[0];
+    auto track = mp4.find("moov/trak[0]");
 
-    auto tkhd = (BoxTKHD*)track->findByType(BOX_TKHD);
-    auto mdhd = (BoxMDHD*)track->findByType(BOX_MDHD);
-    auto hdlr = (BoxHDLR*)track->findByType(BOX_HDLR);
+    auto tkhd = track->find<BoxTKHD>("tkhd");
+    auto mdhd = track->find<BoxMDHD>("mdia/mdhd");
+    auto hdlr = track->find<BoxHDLR>("mdia/hdlr");
     cout << "resoluion: " << tkhd->width/65536 << "x" <<  tkhd->width/65536 << endl;
     cout << "duration: " << mdhd->duration / mdhd->time_scale
          << "sec. (" << mdhd->duration << "/" <<  mdhd->time_scale << endl;
     cout << "type:" << hdlr->typeAsString() << " (" << hdlr->name() << ")" << endl;
 
-    auto stsc = (BoxSTSC*)track->findByType(BOX_STSC);
-    auto stsd = (BoxSTSD*)track->findByType(BOX_STSD);
-    auto stsz = (BoxSTSZ*)track->findByType(BOX_STSZ);
-    auto stco = (BoxSTCO*)track->findByType(BOX_STCO);
-    auto stts = (BoxSTTS*)track->findByType(BOX_STTS);
-    auto ctts = (BoxCTTS*)track->findByType(BOX_CTTS);
-    cout << "samples: " << stsz->count() << endl;
+    auto stsd = track->find<BoxSTSD>("mdia/minf/stbl/stsd");
+    Mp4SampleReader reader(track);
+    const SampleIndex &index = reader.sampleIndex();
+    cout << "samples: " << index.count() << endl;
     cout << "type: " << stsd->typeAsString() << "  config_size:" << stsd->desc().size() << endl;
-    uint32_t lastChunk = -1;
-    uint32_t offset = 0;
-
-    ofstream of("out.flv", ios::binary);
-    size_t prev = 0;
 
-    flv::FLVHeader fh = {{'F','L','V'}, 1, flv::TYPE_FLAG_VIDEO | flv::TYPE_FLAG_AUDIO, 9}; // 9: sizeof(flv::FLVHeader)
-    of << fh;
-    flv::write32(of, 0);
+    int fd = open("out.flv", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "can't open out.flv" << endl;
+        return 1;
+    }
+    flv::FlvWriter of(fd); // buffered. PreviousTagSize is counted by the writer.
+    of.header(flv::TYPE_FLAG_VIDEO | flv::TYPE_FLAG_AUDIO);
 
-    flv::FLVTagHeader th;
-    th.type = flv::TAG_TYPE_VIDEO;
-    th.stream_id = 0;
-    th.timestamp = 0;
+    uint8_t type = flv::TAG_TYPE_VIDEO;
     uint8_t codecId = flv::VCODEC_AVC;
     if (stsd->typeAsString() == "mp4a") {
-        th.type = flv::TAG_TYPE_AUDIO;
+        type = flv::TAG_TYPE_AUDIO;
         codecId = flv::ACODEC_AAC; // TODO esds box.
     }
 
@@ -62,41 +52,27 @@ int main() {
     if (codecId == flv::VCODEC_AVC) {
         int p = desc.find("avcC");
         string config = desc.substr(p + 4);
-        flv::write_video(of, th, config, codecId, 0, true, true);
-
-        flv::write32(of, (uint32_t)of.tellp() - prev);
-        prev = of.tellp();
+        of.video(0, config.data(), config.size(), codecId, 0, true, true);
     } else if (codecId == flv::ACODEC_AAC) {
         int p = desc.find("esds");
         string config = desc.substr(p+30, desc[p+29]); // TODO esds box.
-        flv::write_audio(of, th, config, flv::audio_format(codecId, 2, flv::SOUND_RATE_44K), true);
-
-        flv::write32(of, (uint32_t)of.tellp() - prev);
-        prev = of.tellp();
+        of.audio(0, config.data(), config.size(), flv::audio_format(codecId, 2, flv::SOUND_RATE_44K), true);
     }
 
-    vector<uint8_t> buf;
-    ifs.clear();
-    for (int i=0; i<stsz->count(); i++) {
+    // samples of a chunk are read at once.
+    for (int i=0; !reader.eos(); i++) {
         // read sample
-        auto chunk = stsc->sampleToChunk(i);
-        if (lastChunk != chunk) {
-            lastChunk = chunk;
-            offset = 0;
-        }
-        cout << "timestamp: " << stts->sampleToTime(i) << endl;
-        cout << "  size:" << stsz->size(i) << endl;
-        cout << "  offset: " << stco->offset(chunk) + offset << endl;
+        cout << "timestamp: " << index.dts[i] << endl;
+        cout << "  size:" << index.size[i] << endl;
+        cout << "  offset: " << index.offset[i] << endl;
         uint32_t timeOffset = 0;
-        if (ctts != nullptr) {
-            timeOffset = ctts->sampleToOffset(i);
+        if (index.hasCtsOffset()) {
+            timeOffset = index.ctsOffset(i);
             cout << "  time offset: " << timeOffset << endl;
         }
 
-        buf.resize(stsz->size(i));
-        ifs.seekg(stco->offset(chunk) + offset);
-        ifs.read((char*)&buf[0], buf.size());
-        offset += stsz->size(i); // update offset in chunk.
+        Sample sample = reader.read(ifs);
+        const vector<uint8_t> &buf = sample.data;
 
         // check idr
         bool rap = false;
@@ -111,15 +87,17 @@ int main() {
         }
 
         // write flv tag.
-        th.timestamp = stts->sampleToTime(i) * 1000 / mdhd->time_scale;
-        if (th.type == flv::TAG_TYPE_VIDEO) {
-            flv::write_video(of, th, buf, codecId, timeOffset * 1000 / mdhd->time_scale, rap);
+        uint32_t timestamp = index.dts[i] * 1000 / mdhd->time_scale;
+        if (type == flv::TAG_TYPE_VIDEO) {
+            of.video(timestamp, buf.data(), buf.size(), codecId, timeOffset * 1000 / mdhd->time_scale, rap);
         } else {
-            flv::write_audio(of, th, buf, flv::audio_format(codecId, 2, flv::SOUND_RATE_44K));
+            of.audio(timestamp, buf.data(), buf.size(), flv::audio_format(codecId, 2, flv::SOUND_RATE_44K));
         }
-
-        flv::write32(of, (uint32_t)of.tellp() - prev);
-        prev = of.tellp();
     }
+    if (!of.flush()) {
+        cerr << "write error" << endl;
+        return 1;
+    }
+    close(fd);
     return 0;
 }